@@ -10,19 +10,38 @@ CONDITIONS OF ANY KIND, either express or implied.  See the License for the
 specific language governing permissions and limitations under the License. */
 
 #include "cli.h"
+#include "encode.h"
 #include "opc.h"
 #include "spi.h"
 
-#define APA102_BRIGHTNESS 31  /* overall brightness level, 0 to 31 */
+#define APA102_BRIGHTNESS ENCODE_APA102_LEVEL
 
-static u8 buffer[4 + OPC_MAX_PIXELS_PER_MESSAGE * 4];
+static u8 buffer[4 + OPC_MAX_PIXELS_PER_FRAME * 4];
 static int spi_fd;
+static encode_func* encode;
 
-void apa102_put_pixels(u8* buffer, u16 count, pixel* pixels) {
-  int i;
-  pixel* p;
+void apa102_put_pixels(u8* buffer, u32 count, pixel* pixels) {
   u8* d;
-  u8 flag;
+
+  d = buffer;
+  *d++ = 0;
+  *d++ = 0;
+  *d++ = 0;
+  *d++ = 0;
+  d += encode(d, pixels, count);
+  spi_write(spi_fd, buffer, d - buffer);
+}
+
+// Uses the 5-bit global brightness field of each LED to carry the precision
+// that 8-bit color values lack: each LED gets the lowest brightness level at
+// which its brightest channel still fits in 8 bits, and its channels are
+// scaled up to match.  The APA102 has no white LED, so white is added into
+// red, green and blue.
+void apa102_put_pixels16(u8* buffer, u32 count, pixel16* pixels) {
+  u32 i;
+  pixel16* p;
+  u8* d;
+  u32 r, g, b, max, level, scale;
 
   d = buffer;
   *d++ = 0;
@@ -30,10 +49,19 @@ void apa102_put_pixels(u8* buffer, u16 count, pixel* pixels) {
   *d++ = 0;
   *d++ = 0;
   for (i = 0, p = pixels; i < count; i++, p++) {
-    *d++ = 0xe0 + APA102_BRIGHTNESS;
-    *d++ = p->b;
-    *d++ = p->g;
-    *d++ = p->r;
+    r = p->r + p->w > 0xffff ? 0xffff : p->r + p->w;
+    g = p->g + p->w > 0xffff ? 0xffff : p->g + p->w;
+    b = p->b + p->w > 0xffff ? 0xffff : p->b + p->w;
+    max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+    level = (max*APA102_BRIGHTNESS + 0xfffe)/0xffff;
+    if (level == 0) level = 1;
+
+    // At level L, an 8-bit value v gives v*L/(255*31) of full intensity.
+    scale = 257*level;
+    *d++ = 0xe0 + level;
+    *d++ = (b*APA102_BRIGHTNESS + scale/2)/scale;
+    *d++ = (g*APA102_BRIGHTNESS + scale/2)/scale;
+    *d++ = (r*APA102_BRIGHTNESS + scale/2)/scale;
   }
   spi_write(spi_fd, buffer, d - buffer);
 }
@@ -42,11 +70,22 @@ int main(int argc, char** argv) {
   u16 port = OPC_DEFAULT_PORT;
   u32 spi_speed_hz = 8000000;
   char* spi_device_path = "/dev/spidev1.0";
+  order_t order = BGR;
+  u8 rgbw = 0;
+
+  get_server_options(&argc, &argv);
 
   get_speed_and_port(&spi_speed_hz, &port, argc, argv);
   if (argc > 3) {
     spi_device_path = argv[3];
   }
+  // A few APA102 clones expect the colors in a different order.
+  if (argc > 4 && (!encode_parse_order(argv[4], &order, &rgbw) || rgbw)) {
+    fprintf(stderr, "Did not recognize color order argument - using default\n");
+    order = BGR;
+  }
+  encode = encode_get(APA102, order, 0);
   spi_fd = opc_open_spi(spi_device_path, spi_speed_hz);
+  opc_serve_pixels16(apa102_put_pixels16);
   return opc_serve_main(port, apa102_put_pixels, buffer);
 }
@@ -10,8 +10,11 @@ CONDITIONS OF ANY KIND, either express or implied.  See the License for the
 specific language governing permissions and limitations under the License. */
 
 #include "cli.h"
+#include "color.h"
 #include "spi.h"
+#include "stats.h"
 #include <stdlib.h>
+#include <unistd.h>
 
 void get_speed_and_port(u32* speed, u16* port, int argc, char** argv) {
   if (argc > 1 && speed) {
@@ -22,13 +25,165 @@ void get_speed_and_port(u32* speed, u16* port, int argc, char** argv) {
   }
 }
 
+void get_server_options(int* argc, char*** argv) {
+  double gamma = 1;
+  double white[3] = {1, 1, 1};
+  double limit = 1;
+  u8 dither = 0;
+  int opt;
+
+  // The leading "+" stops at the first argument that is not an option.
+  while ((opt = getopt(*argc, *argv, "+g:w:l:ds:t")) != -1) {
+    switch (opt) {
+      case 'g':
+        gamma = strtod(optarg, NULL);
+        break;
+      case 'w':
+        if (sscanf(optarg, "%lf,%lf,%lf", &white[0], &white[1], &white[2])
+            != 3) {
+          white[0] = -1;
+        }
+        break;
+      case 'l':
+        limit = strtod(optarg, NULL);
+        break;
+      case 'd':
+        dither = 1;
+        break;
+      case 's':
+        stats_set_file(optarg);
+        break;
+      case 't':
+        stats_enable_timing();
+        break;
+      default:
+        fprintf(stderr, "Options: [-g <gamma>] [-w <r>,<g>,<b>] "
+                "[-l <limit>] [-d] [-s <stats file>] [-t]\n");
+        exit(1);
+    }
+  }
+  if (gamma <= 0 || limit < 0 || limit > 1 ||
+      white[0] < 0 || white[0] > 1 || white[1] < 0 || white[1] > 1 ||
+      white[2] < 0 || white[2] > 1) {
+    fprintf(stderr, "Gamma must be positive; white point values and "
+            "limit must be from 0 to 1\n");
+    exit(1);
+  }
+  color_init(gamma, white, limit, dither);
+  if (color_active) {
+    fprintf(stderr, "Color: gamma %.2f, white %.2f,%.2f,%.2f, limit %.2f%s\n",
+            gamma, white[0], white[1], white[2], limit,
+            dither ? ", dithered" : "");
+  }
+
+  // Shift the program name up to replace the options.
+  (*argv)[optind - 1] = (*argv)[0];
+  *argv += optind - 1;
+  *argc -= optind - 1;
+}
+
 static u8* put_pixels_buffer;
 static put_pixels_func* put_pixels;
+static put_pixels16_func* put_pixels16;
+static put_channel_func* put_channel;
+static flush_func* flush;
+
+// The source being served, for its message times and staging
+static opc_source serve_source;
+
+// Corrected pixels; incoming pixels may belong to the OPC source (e.g. a
+// retained frame), so they are never corrected in place.
+static pixel color_pixels[OPC_MAX_PIXELS_PER_FRAME];
+static pixel16 color_pixels16[OPC_MAX_PIXELS_PER_FRAME];
 
-void opc_serve_handler(u8 address, u16 count, pixel* pixels) {
-  fprintf(stderr, "%d ", count);
-  fflush(stderr);
-  put_pixels(put_pixels_buffer, count, pixels);
+// With timing on, records how long the message waited before its handling
+// began at start_ns.
+static void time_dispatch(u64 start_ns) {
+  opc_times times;
+
+  stats_thread_spi_start_ns = 0;
+  opc_get_times(serve_source, &times);
+  if (times.complete_ns) {
+    stats_record(STATS_RECEIVE, times.complete_ns - times.readable_ns);
+    stats_record(STATS_DISPATCH, start_ns - times.complete_ns);
+  }
+}
+
+// Counts a frame whose handling began at start_ns, when the calling thread
+// had spent spi_ns writing to SPI, leaving out any SPI writes since then.
+static void count_frame(u32 count, u64 start_ns, u64 spi_ns) {
+  u64 now = stats_now_ns();
+  opc_times times;
+
+  STATS_ADD(frames, 1);
+  STATS_ADD(pixels, count);
+  STATS_ADD(encode_ns, now - start_ns - (stats_thread_spi_ns - spi_ns));
+  if (stats_timing) {
+    stats_record(STATS_ENCODE, (stats_thread_spi_start_ns ?
+                                stats_thread_spi_start_ns : now) - start_ns);
+    opc_get_times(serve_source, &times);
+    if (times.readable_ns) {
+      stats_record(STATS_TOTAL, now - times.readable_ns);
+    }
+  }
+}
+
+void opc_serve_handler(u8 address, u32 count, pixel* pixels) {
+  u64 start = stats_now_ns();
+  u64 spi_ns = stats_thread_spi_ns;
+
+  if (stats_timing) {
+    time_dispatch(start);
+  }
+  if (put_channel) {
+    if (color_active) {
+      color_apply(color_pixels, pixels, count, address);
+      pixels = color_pixels;
+    }
+    put_channel(address, count, pixels);
+    // A staged frame is flushed once, by the sync handler, when it ends.
+    if (!opc_is_staged(serve_source)) {
+      flush();
+    }
+  } else if (!color_active) {
+    put_pixels(put_pixels_buffer, count, pixels);
+  } else if (put_pixels16) {
+    // Hardware that takes 16-bit data keeps the corrected precision.
+    color_apply_wide(color_pixels16, pixels, count);
+    put_pixels16(put_pixels_buffer, count, color_pixels16);
+  } else {
+    color_apply(color_pixels, pixels, count, address);
+    put_pixels(put_pixels_buffer, count, color_pixels);
+  }
+  count_frame(count, start, spi_ns);
+}
+
+void opc_serve_handler16(u8 address, u32 count, pixel16* pixels) {
+  u64 start = stats_now_ns();
+  u64 spi_ns = stats_thread_spi_ns;
+
+  if (stats_timing) {
+    time_dispatch(start);
+  }
+  if (color_active) {
+    color_apply16(color_pixels16, pixels, count);
+    pixels = color_pixels16;
+  }
+  put_pixels16(put_pixels_buffer, count, pixels);
+  count_frame(count, start, spi_ns);
+}
+
+void opc_serve_pixels16(put_pixels16_func* put16) {
+  put_pixels16 = put16;
+}
+
+void opc_serve_sync_handler() {
+  flush();
+}
+
+void opc_serve_channels(put_channel_func* put, flush_func* f) {
+  put_channel = put;
+  flush = f;
 }
 
 int opc_open_spi(char* spi_device_path, u32 spi_speed_hz) {
@@ -44,11 +199,20 @@ int opc_serve_main(u16 port, put_pixels_func* put, u8* buffer) {
   u16 inactivity_ms = 0;
   int i;
 
-  opc_source s = opc_new_source(port);
+  opc_source s = opc_new_source_multi(port);
   if (s < 0) {
     fprintf(stderr, "Could not create OPC source\n");
     return 1;
   }
+  opc_set_coalescing(s, 1);
+  opc_set_timing(s, stats_timing);
+  serve_source = s;
+  if (put_pixels16) {
+    opc_set_handler16(s, opc_serve_handler16);
+  }
+  if (put_channel) {
+    opc_set_sync_handler(s, opc_serve_sync_handler);
+  }
   fprintf(stderr, "Ready...\n");
   put_pixels = put;
   put_pixels_buffer = buffer;
@@ -60,7 +224,8 @@ int opc_serve_main(u16 port, put_pixels_func* put, u8* buffer) {
   while (inactivity_ms < INACTIVITY_TIMEOUT_MS) {
       if (opc_receive(s, opc_serve_handler, DIAGNOSTIC_TIMEOUT_MS)) {
           inactivity_ms = 0;
-      } else {
+      } else if (!stats_dump_requested) {
+          // (SIGUSR1 also interrupts the wait; that is not inactivity.)
           inactivity_ms += DIAGNOSTIC_TIMEOUT_MS;
           t = time(NULL);
           diagnostic_pixels[0].r = (t % 3 == 0) ? 64 : 0;
@@ -68,6 +233,7 @@ int opc_serve_main(u16 port, put_pixels_func* put, u8* buffer) {
           diagnostic_pixels[0].b = (t % 3 == 2) ? 64 : 0;
           put_pixels(buffer, 5, diagnostic_pixels);
       }
+      stats_tick(s);
   }
   fprintf(stderr, "Exiting after %d ms of inactivity\n",
           INACTIVITY_TIMEOUT_MS);
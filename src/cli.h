@@ -22,9 +22,45 @@ specific language governing permissions and limitations under the License. */
 // should be assigned prior to calling this.
 void get_speed_and_port(u32* speed, u16* port, int argc, char** argv);
 
+// Parses the options that may come before the other arguments, sets up
+// the color stage (see color.h) that opc_serve_main applies to incoming
+// pixels and the stats it reports (see stats.h), and removes the options
+// from argc and argv so that the remaining arguments keep their usual
+// positions.  The options are:
+//   -g <gamma>       gamma exponent, e.g. 2.2 (default 1, no change)
+//   -w <r>,<g>,<b>   white point, as a scale from 0 to 1 for each channel
+//   -l <limit>       overall brightness limit, from 0 to 1
+//   -d               dither the corrected values over successive frames
+//   -s <file>        keep the stats in a file, in Prometheus text format
+//   -t               time each stage of handling a frame, keeping latency
+//                    histograms that SIGUSR1 dumps to stderr
+// Call this first thing in main.
+void get_server_options(int* argc, char*** argv);
+
 // Send pixel data to LED hardware.  Caller is expected to provide a buffer
 // large enough for the hardware-specific data frame for all the pixels.
-typedef void put_pixels_func(u8* buffer, u16 count, pixel* pixels);
+typedef void put_pixels_func(u8* buffer, u32 count, pixel* pixels);
+
+// Send 16-bit pixel data to LED hardware that can use the extra precision.
+// The buffer is the same one given to opc_serve_main.
+typedef void put_pixels16_func(u8* buffer, u32 count, pixel16* pixels);
+
+// Makes opc_serve_main pass 16-bit pixel data to the given function rather
+// than reducing it to 8 bits.  Call this before opc_serve_main.
+void opc_serve_pixels16(put_pixels16_func* put_pixels16);
+
+// Send the pixel data for one channel to whatever LED hardware the channel
+// is routed to.  Nothing need be written out until the flush function runs.
+typedef void put_channel_func(u8 channel, u32 count, pixel* pixels);
+
+// Write out all the pixel data given to the put_channel function.
+typedef void flush_func();
+
+// Makes opc_serve_main pass each message's channel and pixel data to the
+// given put_channel function instead of put_pixels, then call flush: after
+// each message, or for a frame that a client ends with OPC_STREAM_SYNC,
+// only after the whole frame.  Call this before opc_serve_main.
+void opc_serve_channels(put_channel_func* put_channel, flush_func* flush);
 
 // Listen for TCP connections on the specified port, receive OPC data, and
 // transmit it to the specified SPI device using the given put_pixels function.
@@ -0,0 +1,289 @@
+/* Copyright 2013 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+#include <string.h>
+#include "codec.h"
+
+/* RLE works on 3-byte units (one RGB pixel).  A control byte c below 128 */
+/* is followed by c + 1 literal units; a control byte c of 128 or more is */
+/* followed by one unit to be repeated c - 126 times (2 to 129).  Any */
+/* bytes left over after the last whole unit are appended as they are. */
+#define CODEC_RLE_MAX_LITERALS 128
+#define CODEC_RLE_MAX_RUN 129
+
+#define CODEC_SAME_UNIT(p, q) \
+    ((p)[0] == (q)[0] && (p)[1] == (q)[1] && (p)[2] == (q)[2])
+
+static u32 codec_rle_compress(u8* out, u32 max, u8* in, u32 length) {
+  u32 units = length/3;
+  u32 tail = length - units*3;
+  u8* d = out;
+  u8* end = out + max;
+  u32 start;
+  u32 run;
+  u32 i = 0;
+
+  while (i < units) {
+    for (run = 1; i + run < units && run < CODEC_RLE_MAX_RUN &&
+         CODEC_SAME_UNIT(in + 3*i, in + 3*(i + run)); run++);
+    if (run >= 2) {
+      if (end - d < 4) {
+        return 0;
+      }
+      *d++ = 126 + run;
+      memcpy(d, in + 3*i, 3);
+      d += 3;
+      i += run;
+      continue;
+    }
+
+    /* Gather literals up to the start of the next run. */
+    start = i;
+    do {
+      i++;
+    } while (i < units && i - start < CODEC_RLE_MAX_LITERALS &&
+             !(i + 1 < units && CODEC_SAME_UNIT(in + 3*i, in + 3*(i + 1))));
+    if (end - d < 1 + 3*(i - start)) {
+      return 0;
+    }
+    *d++ = i - start - 1;
+    memcpy(d, in + 3*start, 3*(i - start));
+    d += 3*(i - start);
+  }
+  if (end - d < tail) {
+    return 0;
+  }
+  memcpy(d, in + 3*units, tail);
+  return d + tail - out;
+}
+
+static u8 codec_rle_decompress(u8* out, u32 length, u8* in, u32 in_length) {
+  u32 units = length/3;
+  u32 tail = length - units*3;
+  u8* s = in;
+  u8* s_end;
+  u8* d = out;
+  u32 n;
+
+  if (in_length < tail) {
+    return 0;
+  }
+  s_end = in + in_length - tail;
+  while (s < s_end) {
+    if (*s < 128) {
+      n = *s++ + 1;
+      if (s_end - s < 3*n || units - (d - out)/3 < n) {
+        return 0;
+      }
+      memcpy(d, s, 3*n);
+      d += 3*n;
+      s += 3*n;
+    } else {
+      n = *s++ - 126;
+      if (s_end - s < 3 || units - (d - out)/3 < n) {
+        return 0;
+      }
+      for (; n > 0; n--, d += 3) {
+        memcpy(d, s, 3);
+      }
+      s += 3;
+    }
+  }
+  if (d != out + 3*units) {
+    return 0;
+  }
+  memcpy(d, s_end, tail);
+  return 1;
+}
+
+/* The LZ codec produces LZ4 blocks.  Each sequence is a token byte (the */
+/* literal count in the high nibble and the match length minus 4 in the */
+/* low nibble, 15 meaning that more length bytes follow), the literals, */
+/* a 2-byte little-endian offset back into the output, and any further */
+/* match length bytes.  The last sequence has literals only.  Matches are */
+/* found with a single-entry hash table of 4-byte sequences. */
+#define CODEC_LZ_HASH_BITS 12
+#define CODEC_LZ_MIN_MATCH 4
+#define CODEC_LZ_MAX_OFFSET 65535
+#define CODEC_LZ_END_LITERALS 5  /* the last bytes are always literals */
+#define CODEC_LZ_MATCH_LIMIT 12  /* no match starts this close to the end */
+#define CODEC_LZ_SKIP_SHIFT 6  /* step up the search after 64 misses */
+
+static u32 codec_read32(u8* p) {
+  u32 value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+static u32 codec_lz_hash(u32 value) {
+  return (value * 2654435761u) >> (32 - CODEC_LZ_HASH_BITS);
+}
+
+/* Writes the remainder of a length that did not fit in its nibble. */
+static u8* codec_lz_put_length(u8* d, u32 n) {
+  for (; n >= 255; n -= 255) {
+    *d++ = 255;
+  }
+  *d++ = n;
+  return d;
+}
+
+/* Appends one sequence (no match if match_length is 0), or returns NULL */
+/* if it might not fit before end. */
+static u8* codec_lz_put_sequence(u8* d, u8* end, u8* literals,
+                                 u32 num_literals, u32 offset,
+                                 u32 match_length) {
+  u8* token = d;
+
+  if (end - d < 1 + num_literals + num_literals/255 + 1 + 2 +
+      match_length/255 + 1) {
+    return NULL;
+  }
+  *d++ = (num_literals < 15 ? num_literals : 15) << 4;
+  if (num_literals >= 15) {
+    d = codec_lz_put_length(d, num_literals - 15);
+  }
+  memcpy(d, literals, num_literals);
+  d += num_literals;
+  if (match_length) {
+    *d++ = offset & 0xff;
+    *d++ = offset >> 8;
+    match_length -= CODEC_LZ_MIN_MATCH;
+    *token |= match_length < 15 ? match_length : 15;
+    if (match_length >= 15) {
+      d = codec_lz_put_length(d, match_length - 15);
+    }
+  }
+  return d;
+}
+
+static u32 codec_lz_compress(u8* out, u32 max, u8* in, u32 length) {
+  u32 table[1 << CODEC_LZ_HASH_BITS];
+  u8* d = out;
+  u8* end = out + max;
+  u32 anchor = 0;
+  u32 misses = 0;
+  u32 value;
+  u32 match;
+  u32 match_length;
+  u32 h;
+  u32 i = 0;
+
+  memset(table, 0, sizeof(table));
+  while (length >= CODEC_LZ_MATCH_LIMIT &&
+         i <= length - CODEC_LZ_MATCH_LIMIT) {
+    value = codec_read32(in + i);
+    h = codec_lz_hash(value);
+    match = table[h];
+    table[h] = i;
+    if (match >= i || i - match > CODEC_LZ_MAX_OFFSET ||
+        codec_read32(in + match) != value) {
+      i += 1 + (misses++ >> CODEC_LZ_SKIP_SHIFT);
+      continue;
+    }
+    for (match_length = CODEC_LZ_MIN_MATCH;
+         i + match_length < length - CODEC_LZ_END_LITERALS &&
+         in[match + match_length] == in[i + match_length]; match_length++);
+    d = codec_lz_put_sequence(d, end, in + anchor, i - anchor,
+                              i - match, match_length);
+    if (!d) {
+      return 0;
+    }
+    i += match_length;
+    anchor = i;
+    misses = 0;
+  }
+  d = codec_lz_put_sequence(d, end, in + anchor, length - anchor, 0, 0);
+  return d ? d - out : 0;
+}
+
+/* Reads the remainder of a length whose nibble was 15 into *n.  Returns */
+/* the new read position, or NULL if the input ends first. */
+static u8* codec_lz_get_length(u8* s, u8* s_end, u32* n) {
+  u8 b;
+
+  do {
+    if (s >= s_end) {
+      return NULL;
+    }
+    b = *s++;
+    *n += b;
+  } while (b == 255);
+  return s;
+}
+
+static u8 codec_lz_decompress(u8* out, u32 length, u8* in, u32 in_length) {
+  u8* s = in;
+  u8* s_end = in + in_length;
+  u8* d = out;
+  u8* d_end = out + length;
+  u32 offset;
+  u32 n;
+  u8 token;
+
+  while (s < s_end) {
+    token = *s++;
+    n = token >> 4;
+    if (n == 15 && !(s = codec_lz_get_length(s, s_end, &n))) {
+      return 0;
+    }
+    if (s_end - s < n || d_end - d < n) {
+      return 0;
+    }
+    memcpy(d, s, n);
+    d += n;
+    s += n;
+    if (s == s_end) {
+      break;  /* the last sequence has no match */
+    }
+    if (s_end - s < 2) {
+      return 0;
+    }
+    offset = s[0] | (s[1] << 8);
+    s += 2;
+    n = (token & 15) + CODEC_LZ_MIN_MATCH;
+    if ((token & 15) == 15 && !(s = codec_lz_get_length(s, s_end, &n))) {
+      return 0;
+    }
+    if (offset == 0 || offset > d - out || d_end - d < n) {
+      return 0;
+    }
+    if (offset >= n) {
+      memcpy(d, d - offset, n);
+      d += n;
+    } else {
+      for (; n > 0; n--, d++) {
+        *d = *(d - offset);  /* the source overlaps the destination */
+      }
+    }
+  }
+  return d == d_end;
+}
+
+u32 codec_compress(u8 codec, u8* out, u32 max, u8* in, u32 length) {
+  switch (codec) {
+    case OPC_CODEC_RLE:
+      return codec_rle_compress(out, max, in, length);
+    case OPC_CODEC_LZ:
+      return codec_lz_compress(out, max, in, length);
+  }
+  return 0;
+}
+
+u8 codec_decompress(u8 codec, u8* out, u32 length, u8* in, u32 in_length) {
+  switch (codec) {
+    case OPC_CODEC_RLE:
+      return codec_rle_decompress(out, length, in, in_length);
+    case OPC_CODEC_LZ:
+      return codec_lz_decompress(out, length, in, in_length);
+  }
+  return 0;
+}
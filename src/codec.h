@@ -0,0 +1,28 @@
+/* Copyright 2013 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// Lossless codecs for OPC_COMPRESSED payloads.
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "opc.h"
+
+/* Compresses length bytes from in into out using the given codec */
+/* (OPC_CODEC_RLE or OPC_CODEC_LZ), writing at most max bytes.  Returns */
+/* the compressed length, or 0 if the result would not fit in max bytes. */
+u32 codec_compress(u8 codec, u8* out, u32 max, u8* in, u32 length);
+
+/* Decompresses in_length bytes from in into out, which has room for */
+/* exactly length bytes.  Returns 1 if the data was valid and decoded to */
+/* exactly length bytes, 0 otherwise. */
+u8 codec_decompress(u8 codec, u8* out, u32 length, u8* in, u32 in_length);
+
+#endif /* CODEC_H */
@@ -0,0 +1,155 @@
+/* Copyright 2013 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// Measures the OPC_COMPRESSED codecs on typical frames and compares the
+// time they cost per frame with the time they save on a link of given speed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "codec.h"
+
+double now_us() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1e6 + t.tv_nsec*1e-3;
+}
+
+// Fills a frame with one of the test patterns; returns its name.
+char* make_frame(int pattern, pixel* pixels, int count) {
+  int i;
+
+  memset(pixels, 0, count*sizeof(pixel));
+  switch (pattern) {
+    case 0:
+      for (i = 0; i < count; i++) {
+        pixels[i].r = 255;
+        pixels[i].g = 128;
+      }
+      return "solid";
+    case 1:
+      for (i = 0; i < count; i++) {
+        pixels[i].r = i*255/count;
+        pixels[i].b = 255 - i*255/count;
+      }
+      return "gradient";
+    case 2:
+      for (i = 0; i < count/50; i++) {
+        pixels[rand() % count].g = rand();
+      }
+      return "sparkle";
+    case 3:
+      for (i = 0; i < count; i++) {
+        pixels[i].r = rand();
+        pixels[i].g = rand();
+        pixels[i].b = rand();
+      }
+      return "noise";
+  }
+  return NULL;
+}
+
+void usage(char* prog_name) {
+  fprintf(stderr, "Usage: %s [-n <pixels>] [-b <Mbit/s>] [-i <iterations>]\n",
+          prog_name);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  int count = 10000;
+  double mbps = 4;
+  int iterations = 200;
+  char* codec_names[] = {"none", "rle", "lz"};
+  pixel* pixels;
+  u8* packed;
+  u8* unpacked;
+  u32 raw_length, length = 0;
+  double start, encode_us, decode_us, link_us;
+  char* name;
+  int opt, pattern, codec, i;
+
+  while ((opt = getopt(argc, argv, ":hn:b:i:")) != -1)
+  {
+      switch (opt)
+      {
+      case 'n':
+          count = atoi(optarg);
+          break;
+      case 'b':
+          mbps = strtod(optarg, NULL);
+          break;
+      case 'i':
+          iterations = atoi(optarg);
+          break;
+      case ':':
+          fprintf(stderr, "Missing argument to option: '%c'\n", optopt);
+          usage(argv[0]);
+      case '?':
+          fprintf(stderr, "Option not recognized: '%c'\n", optopt);
+          usage(argv[0]);
+      case 'h':
+      default:
+          usage(argv[0]);
+      }
+  }
+  if (optind != argc || count < 1 || count > OPC_MAX_PIXELS_PER_FRAME ||
+      mbps <= 0 || iterations < 1) {
+      usage(argv[0]);
+  }
+
+  raw_length = count*3;
+  pixels = malloc(raw_length);
+  packed = malloc(raw_length);
+  unpacked = malloc(raw_length);
+  printf("%d pixels (%u bytes) per frame, %.1f Mbit/s link\n\n",
+         count, raw_length, mbps);
+  printf("%-9s %-5s %8s %7s %11s %11s %11s %9s\n", "pattern", "codec",
+         "bytes", "ratio", "encode us", "decode us", "frame us", "max fps");
+  for (pattern = 0; (name = make_frame(pattern, pixels, count)); pattern++) {
+    for (codec = OPC_CODEC_NONE; codec <= OPC_CODEC_LZ; codec++) {
+      encode_us = decode_us = 0;
+      if (codec == OPC_CODEC_NONE) {
+        length = raw_length;
+      } else {
+        start = now_us();
+        for (i = 0; i < iterations; i++) {
+          length = codec_compress(codec, packed, raw_length,
+                                  (u8*) pixels, raw_length);
+        }
+        encode_us = (now_us() - start)/iterations;
+        if (!length) {
+          printf("%-9s %-5s %8s\n", name, codec_names[codec], "(larger)");
+          continue;
+        }
+        start = now_us();
+        for (i = 0; i < iterations; i++) {
+          if (!codec_decompress(codec, unpacked, raw_length, packed, length) ||
+              memcmp(unpacked, pixels, raw_length)) {
+            fprintf(stderr, "%s: %s round trip failed\n",
+                    name, codec_names[codec]);
+            return 1;
+          }
+        }
+        decode_us = (now_us() - start)/iterations;
+      }
+
+      // One frame costs its transmission time plus encoding and decoding.
+      link_us = length*8/mbps;
+      printf("%-9s %-5s %8u %6.1fx %11.1f %11.1f %11.1f %9.1f\n",
+             name, codec_names[codec], length, (double) raw_length/length,
+             encode_us, decode_us, link_us + encode_us + decode_us,
+             1e6/(link_us + encode_us + decode_us));
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,144 @@
+/* Copyright 2016 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "color.h"
+
+u8 color_active = 0;
+
+/* Corrected 16-bit values for each 8-bit input value, per channel */
+static u16 color_lut8[3][256];
+
+/* Corrected 16-bit values for every 16th 16-bit input value, per channel */
+/* including white; values in between are interpolated */
+static u16 color_lut16[4][COLOR_LUT16_SIZE];
+
+/* Nonzero if color_apply dithers */
+static u8 color_dither = 0;
+
+/* Rounding error carried into the next frame on each OPC channel, 3 bytes */
+/* per pixel for color_error_counts[c] pixels, or NULL until channel c is */
+/* first dithered.  Channels may go to different pixels, so each keeps */
+/* its own. */
+static u8* color_errors[256];
+static u32 color_error_counts[256];
+
+static u16 color_correct(double v, double gamma, double scale) {
+  double result = floor(65535*scale*pow(v, gamma) + 0.5);
+  return result > 65535 ? 65535 : result;
+}
+
+void color_init(double gamma, double* white, double limit, u8 dither) {
+  int c;
+  int i;
+
+  for (c = 0; c < 4; c++) {
+    for (i = 0; c < 3 && i < 256; i++) {
+      color_lut8[c][i] = color_correct(i/255.0, gamma, limit*white[c]);
+    }
+    for (i = 0; i < COLOR_LUT16_SIZE; i++) {
+      color_lut16[c][i] = color_correct(
+          i*16/65535.0, gamma, c < 3 ? limit*white[c] : limit);
+    }
+  }
+  for (c = 0; c < 256; c++) {
+    free(color_errors[c]);
+    color_errors[c] = NULL;
+    color_error_counts[c] = 0;
+  }
+  color_dither = dither;
+  color_active = gamma != 1 || limit != 1 ||
+      white[0] != 1 || white[1] != 1 || white[2] != 1 || dither;
+}
+
+/* Returns the error buffer for a channel, grown to at least count pixels, */
+/* or NULL if there is no memory for it. */
+static u8* color_get_error(u8 channel, u32 count) {
+  u8* e;
+
+  if (color_error_counts[channel] < count) {
+    e = realloc(color_errors[channel], count*3);
+    if (!e) {
+      fprintf(stderr, "Out of memory for dithering channel %d\n", channel);
+      return NULL;
+    }
+    memset(e + color_error_counts[channel]*3, 0,
+           (count - color_error_counts[channel])*3);
+    color_errors[channel] = e;
+    color_error_counts[channel] = count;
+  }
+  return color_errors[channel];
+}
+
+/* Reduces a 16-bit value to 8 bits, rounding to nearest. */
+#define COLOR_REDUCE(v) (((v) + 128 - ((v) >> 8)) >> 8)
+
+/* Corrects byte k of channel c, carrying its rounding error in e[k]. */
+/* v - (v >> 8) scales 0..65535 to 0..255*256, so adding an error below */
+/* 256 never overflows 8 bits. */
+#define COLOR_DITHER(k, c) \
+    v = color_lut8[c][s[k]]; \
+    v = v - (v >> 8) + e[k]; \
+    d[k] = v >> 8; \
+    e[k] = v
+
+/* Looks up a 16-bit value for channel c, interpolating between entries. */
+#define COLOR_LOOKUP16(c, v) (color_lut16[c][(v) >> 4] + \
+    (((color_lut16[c][((v) >> 4) + 1] - color_lut16[c][(v) >> 4]) * \
+      (s32) ((v) & 15)) >> 4))
+
+void color_apply(pixel* out, pixel* in, u32 count, u8 channel) {
+  u8* s = (u8*) in;
+  u8* d = (u8*) out;
+  u8* e = color_dither ? color_get_error(channel, count) : NULL;
+  u32 v;
+  u32 i;
+
+  if (!e) {
+    for (i = 0; i < count*3; i += 3) {
+      d[i] = COLOR_REDUCE(color_lut8[0][s[i]]);
+      d[i + 1] = COLOR_REDUCE(color_lut8[1][s[i + 1]]);
+      d[i + 2] = COLOR_REDUCE(color_lut8[2][s[i + 2]]);
+    }
+    return;
+  }
+
+  for (i = 0; i < count*3; i += 3) {
+    COLOR_DITHER(i, 0);
+    COLOR_DITHER(i + 1, 1);
+    COLOR_DITHER(i + 2, 2);
+  }
+}
+
+void color_apply_wide(pixel16* out, pixel* in, u32 count) {
+  u32 i;
+
+  for (i = 0; i < count; i++) {
+    out[i].r = color_lut8[0][in[i].r];
+    out[i].g = color_lut8[1][in[i].g];
+    out[i].b = color_lut8[2][in[i].b];
+    out[i].w = 0;
+  }
+}
+
+void color_apply16(pixel16* out, pixel16* in, u32 count) {
+  u32 i;
+
+  for (i = 0; i < count; i++) {
+    out[i].r = COLOR_LOOKUP16(0, in[i].r);
+    out[i].g = COLOR_LOOKUP16(1, in[i].g);
+    out[i].b = COLOR_LOOKUP16(2, in[i].b);
+    out[i].w = COLOR_LOOKUP16(3, in[i].w);
+  }
+}
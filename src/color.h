@@ -0,0 +1,43 @@
+/* Copyright 2016 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// Color correction applied by the server to incoming pixels: gamma, white
+// point and a brightness limit, all folded into per-channel lookup tables.
+#ifndef COLOR_H
+#define COLOR_H
+
+#include "types.h"
+
+/* Number of entries in the tables for 16-bit input: one for every 16th */
+/* value, and one more to interpolate towards at the top */
+#define COLOR_LUT16_SIZE 4097
+
+/* Nonzero once color_init has set up a correction other than identity. */
+extern u8 color_active;
+
+/* Builds the lookup tables.  Each value v (scaled to 0..1) becomes */
+/* limit * white[c] * v^gamma for channel c (R, G, B), and limit * v^gamma */
+/* for white.  If dither is set, color_apply spreads the part of each */
+/* corrected value below 8 bits over successive frames. */
+void color_init(double gamma, double* white, double limit, u8 dither);
+
+/* Corrects count 8-bit pixels from in into out, which may be the same. */
+/* With dithering, pixel i of the given OPC channel keeps its rounding */
+/* error for the channel's next frame. */
+void color_apply(pixel* out, pixel* in, u32 count, u8 channel);
+
+/* Corrects count 8-bit pixels from in into 16-bit pixels in out. */
+void color_apply_wide(pixel16* out, pixel* in, u32 count);
+
+/* Corrects count 16-bit pixels from in into out, which may be the same. */
+void color_apply16(pixel16* out, pixel16* in, u32 count);
+
+#endif /* COLOR_H */
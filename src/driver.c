@@ -0,0 +1,73 @@
+/* Copyright 2016 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+#include <string.h>
+#include "driver.h"
+#include "spi.h"
+
+static void driver_spi_write(int fd, u32 speed_hz, u8* frame, u32 len,
+                             u16 delay_us) {
+  spi_transfer(fd, speed_hz, frame, NULL, len, delay_us);
+}
+
+/* The built-in drivers frame and time their output like the */
+/* single-chipset servers. */
+static driver driver_builtins[] = {
+  {"apa102", APA102, 4, 0, 8000000, 0, BGR, init_spidev, driver_spi_write},
+  {"tcl", TCL, 4, 0, 8000000, 0, BGR, init_spidev, driver_spi_write},
+  {"ws2801", WS2801, 0, 0, 4000000, 1000, RGB, init_spidev, driver_spi_write},
+  {"lpd8806", LPD8806, 3, 1, 2000000, 1000, GRB, init_spidev,
+   driver_spi_write}
+};
+
+static driver* drivers[DRIVER_MAX_DRIVERS];
+static int num_drivers = -1;
+
+/* Starts the registry off with the built-in drivers. */
+static void driver_init() {
+  int i;
+
+  if (num_drivers < 0) {
+    num_drivers = sizeof(driver_builtins)/sizeof(driver);
+    for (i = 0; i < num_drivers; i++) {
+      drivers[i] = &driver_builtins[i];
+    }
+  }
+}
+
+u8 driver_register(driver* drv) {
+  int i;
+
+  driver_init();
+  for (i = 0; i < num_drivers; i++) {
+    if (!strcmp(drivers[i]->name, drv->name)) {
+      drivers[i] = drv;
+      return 1;
+    }
+  }
+  if (num_drivers >= DRIVER_MAX_DRIVERS) {
+    return 0;
+  }
+  drivers[num_drivers++] = drv;
+  return 1;
+}
+
+driver* driver_find(char* name) {
+  int i;
+
+  driver_init();
+  for (i = 0; i < num_drivers; i++) {
+    if (!strcmp(drivers[i]->name, name)) {
+      return drivers[i];
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,53 @@
+/* Copyright 2016 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// A registry of LED output drivers, each of which knows how to frame and
+// send pixels encoded for one chipset.
+#ifndef DRIVER_H
+#define DRIVER_H
+
+#include "encode.h"
+#include "types.h"
+
+#define DRIVER_MAX_DRIVERS 16
+
+/* Opens an output at the given path and speed; returns a file descriptor, */
+/* or -1 on failure. */
+typedef int driver_open_func(char* path, u32 speed_hz);
+
+/* Sends a whole frame to an output, then pauses for delay_us. */
+typedef void driver_write_func(int fd, u32 speed_hz, u8* frame, u32 len,
+                               u16 delay_us);
+
+/* A driver sends frames made of start_bytes zero bytes, the pixels as */
+/* encoded for its chipset, then end_bytes zero bytes.  The speed, delay */
+/* and color order are defaults that each output can override. */
+typedef struct {
+  char* name;
+  chipset_t chipset;
+  u8 start_bytes;
+  u8 end_bytes;
+  u32 speed_hz;
+  u16 delay_us;
+  order_t order;
+  driver_open_func* open;
+  driver_write_func* write;
+} driver;
+
+/* Adds a driver to the registry, replacing any with the same name. */
+/* Returns 1 on success, 0 if the registry is full. */
+u8 driver_register(driver* drv);
+
+/* Returns the registered driver with the given name, or NULL if none. */
+/* The SPI drivers "apa102", "tcl", "ws2801" and "lpd8806" are built in. */
+driver* driver_find(char* name);
+
+#endif /* DRIVER_H */
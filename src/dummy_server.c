@@ -13,7 +13,7 @@ specific language governing permissions and limitations under the License. */
 #include <stdlib.h>
 #include "opc.h"
 
-void handler(u8 channel, u16 count, pixel* pixels) {
+void handler(u8 channel, u32 count, pixel* pixels) {
   int i = 0;
   char* sep = " =";
   printf("-> channel %d: %d pixel%s", channel, count, count == 1 ? "" : "s");
@@ -30,7 +30,7 @@ void handler(u8 channel, u16 count, pixel* pixels) {
 
 int main(int argc, char** argv) {
   u16 port = argc > 1 ? atoi(argv[1]) : OPC_DEFAULT_PORT;
-  opc_source s = opc_new_source(port);
+  opc_source s = opc_new_source_multi(port);
   while (s >= 0) {
     opc_receive(s, handler, 10000);
   }
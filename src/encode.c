@@ -0,0 +1,378 @@
+/* Copyright 2013 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+#include <string.h>
+#include "encode.h"
+
+/* Each encoder runs a vector loop over as many pixels as it safely can, */
+/* then finishes the rest (or all, without a vector unit) one at a time. */
+/* On x86, the SSSE3 loops are compiled for SSSE3 whatever the compiler */
+/* targets, and encode_get picks them if the CPU has it.  NEON is part of */
+/* every ARMv8 CPU, so its loops are used wherever the compiler targets it. */
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define ENCODE_SSSE3
+#define ENCODE_SSSE3_TARGET __attribute__((target("ssse3")))
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ENCODE_NEON
+#endif
+
+#if defined(ENCODE_NEON)
+char* encode_isa = "neon";
+#else
+char* encode_isa = "scalar";
+#endif
+
+u8 encode_simd = 1;
+
+/* The SSSE3 loops load 16 bytes at a time, which is 5 1/3 pixels, so they */
+/* stop while at least 6 pixels remain to keep loads and stores in bounds. */
+#define ENCODE_SSSE3_MARGIN 6
+
+/* The NEON loops deinterleave 16 pixels at a time. */
+#define ENCODE_NEON_PIXELS 16
+
+/* The bodies below take the color order (o0, o1, o2: which of R, G, B */
+/* goes in each position) and a variant flag as arguments, but are always */
+/* inlined into encoders that pass constants, so each encoder is compiled */
+/* with its order and variant fixed.  Each body starts at pixel i, after */
+/* any pixels that its SSSE3 loop (encode_<body>_ssse3) has done. */
+#define ENCODE_INLINE static inline __attribute__((always_inline))
+
+#if defined(ENCODE_SSSE3)
+/* The SSSE3 loop of encode_quad below.  Returns the number of pixels done. */
+ENCODE_INLINE ENCODE_SSSE3_TARGET u32 encode_quad_ssse3(
+    u8* out, pixel* pixels, u32 count, int o0, int o1, int o2, u8 tcl) {
+  u8* s = (u8*) pixels;
+  u32 i = 0;
+  __m128i mask = _mm_setr_epi8(
+      -128, o0, o1, o2, -128, 3 + o0, 3 + o1, 3 + o2,
+      -128, 6 + o0, 6 + o1, 6 + o2, -128, 9 + o0, 9 + o1, 9 + o2);
+  __m128i v;
+  __m128i f;
+
+  /* Each 32-bit lane holds one pixel as its header and values from low */
+  /* to high. */
+  for (; encode_simd && count - i >= ENCODE_SSSE3_MARGIN; i += 4) {
+    v = _mm_loadu_si128((__m128i*) (s + 3*i));
+    v = _mm_shuffle_epi8(v, mask);
+    if (tcl) {
+      f = _mm_srli_epi32(v, 30);
+      f = _mm_or_si128(f, _mm_and_si128(_mm_srli_epi32(v, 20),
+                                        _mm_set1_epi32(0x0c)));
+      f = _mm_or_si128(f, _mm_and_si128(_mm_srli_epi32(v, 10),
+                                        _mm_set1_epi32(0x30)));
+      v = _mm_or_si128(v, _mm_xor_si128(f, _mm_set1_epi32(0xff)));
+    } else {
+      v = _mm_or_si128(v, _mm_set1_epi32(0xe0 | ENCODE_APA102_LEVEL));
+    }
+    _mm_storeu_si128((__m128i*) (out + 4*i), v);
+  }
+  return i;
+}
+#endif
+
+/* Four bytes per pixel: a header byte, then the three values.  The header */
+/* is the APA102 brightness byte, or if tcl is set the P9813 flag byte. */
+ENCODE_INLINE u32 encode_quad(u8* out, pixel* pixels, u32 count,
+                              int o0, int o1, int o2, u8 tcl, u32 i) {
+  u8* s = (u8*) pixels;
+  u8* d;
+  u8 flag;
+
+#if defined(ENCODE_NEON)
+  uint8x16_t top = vdupq_n_u8(0xc0);
+  uint8x16x3_t rgb;
+  uint8x16x4_t v;
+
+  v.val[0] = vdupq_n_u8(0xe0 | ENCODE_APA102_LEVEL);
+  for (; encode_simd && count - i >= ENCODE_NEON_PIXELS;
+       i += ENCODE_NEON_PIXELS) {
+    rgb = vld3q_u8(s + 3*i);
+    v.val[1] = rgb.val[o0];
+    v.val[2] = rgb.val[o1];
+    v.val[3] = rgb.val[o2];
+    if (tcl) {
+      v.val[0] = vmvnq_u8(vorrq_u8(
+          vshrq_n_u8(v.val[3], 6),
+          vorrq_u8(vshrq_n_u8(vandq_u8(v.val[2], top), 4),
+                   vshrq_n_u8(vandq_u8(v.val[1], top), 2))));
+    }
+    vst4q_u8(out + 4*i, v);
+  }
+#endif
+  for (s += 3*i, d = out + 4*i; i < count; i++, s += 3, d += 4) {
+    if (tcl) {
+      flag = (s[o2] & 0xc0) >> 6 | (s[o1] & 0xc0) >> 4 | (s[o0] & 0xc0) >> 2;
+      d[0] = ~flag;
+    } else {
+      d[0] = 0xe0 | ENCODE_APA102_LEVEL;
+    }
+    d[1] = s[o0];
+    d[2] = s[o1];
+    d[3] = s[o2];
+  }
+  return count*4;
+}
+
+#if defined(ENCODE_SSSE3)
+/* The SSSE3 loop of encode_triple below.  Returns the number of pixels done. */
+ENCODE_INLINE ENCODE_SSSE3_TARGET u32 encode_triple_ssse3(
+    u8* out, pixel* pixels, u32 count, int o0, int o1, int o2, u8 lpd) {
+  u8* s = (u8*) pixels;
+  u32 i = 0;
+  __m128i mask = _mm_setr_epi8(
+      o0, o1, o2, 3 + o0, 3 + o1, 3 + o2, 6 + o0, 6 + o1, 6 + o2,
+      9 + o0, 9 + o1, 9 + o2, 12 + o0, 12 + o1, 12 + o2, -128);
+  __m128i v;
+
+  /* Each store also writes the first byte of the next pixel, which the */
+  /* next store or the scalar loop then overwrites.  For the LPD8806, a */
+  /* 16-bit shift moves a bit into the top of each low byte, but that bit */
+  /* is set anyway. */
+  for (; encode_simd && count - i >= ENCODE_SSSE3_MARGIN; i += 5) {
+    v = _mm_loadu_si128((__m128i*) (s + 3*i));
+    v = _mm_shuffle_epi8(v, mask);
+    if (lpd) {
+      v = _mm_or_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(0x80));
+    }
+    _mm_storeu_si128((__m128i*) (out + 3*i), v);
+  }
+  return i;
+}
+#endif
+
+/* Three bytes per pixel: the values, or if lpd is set the values as 7 */
+/* bits with the high bit set. */
+ENCODE_INLINE u32 encode_triple(u8* out, pixel* pixels, u32 count,
+                                int o0, int o1, int o2, u8 lpd, u32 i) {
+  u8* s = (u8*) pixels;
+  u8* d;
+
+#if defined(ENCODE_NEON)
+  uint8x16_t high = vdupq_n_u8(0x80);
+  uint8x16x3_t rgb;
+  uint8x16x3_t v;
+
+  for (; encode_simd && count - i >= ENCODE_NEON_PIXELS;
+       i += ENCODE_NEON_PIXELS) {
+    rgb = vld3q_u8(s + 3*i);
+    v.val[0] = rgb.val[o0];
+    v.val[1] = rgb.val[o1];
+    v.val[2] = rgb.val[o2];
+    if (lpd) {
+      v.val[0] = vorrq_u8(vshrq_n_u8(v.val[0], 1), high);
+      v.val[1] = vorrq_u8(vshrq_n_u8(v.val[1], 1), high);
+      v.val[2] = vorrq_u8(vshrq_n_u8(v.val[2], 1), high);
+    }
+    vst3q_u8(out + 3*i, v);
+  }
+#endif
+  for (s += 3*i, d = out + 3*i; i < count; i++, s += 3, d += 3) {
+    if (lpd) {
+      d[0] = 0x80 | s[o0] >> 1;
+      d[1] = 0x80 | s[o1] >> 1;
+      d[2] = 0x80 | s[o2] >> 1;
+    } else {
+      d[0] = s[o0];
+      d[1] = s[o1];
+      d[2] = s[o2];
+    }
+  }
+  return count*3;
+}
+
+#if defined(ENCODE_SSSE3)
+/* The SSSE3 loop of encode_white below.  Returns the number of pixels done. */
+ENCODE_INLINE ENCODE_SSSE3_TARGET u32 encode_white_ssse3(
+    u8* out, pixel* pixels, u32 count, int o0, int o1, int o2, u8 lpd) {
+  u8* s = (u8*) pixels;
+  u32 i = 0;
+  __m128i mask = _mm_setr_epi8(
+      o0, o1, o2, -128, 3 + o0, 3 + o1, 3 + o2, -128,
+      6 + o0, 6 + o1, 6 + o2, -128, 9 + o0, 9 + o1, 9 + o2, -128);
+  __m128i v;
+  __m128i m;
+
+  /* Each 32-bit lane holds one pixel as its values and 0 from low to */
+  /* high; the low byte of m ends up as the least of the three. */
+  for (; encode_simd && count - i >= ENCODE_SSSE3_MARGIN; i += 4) {
+    v = _mm_loadu_si128((__m128i*) (s + 3*i));
+    v = _mm_shuffle_epi8(v, mask);
+    m = _mm_min_epu8(v, _mm_srli_epi32(v, 8));
+    m = _mm_min_epu8(m, _mm_srli_epi32(v, 16));
+    m = _mm_and_si128(m, _mm_set1_epi32(0xff));
+    v = _mm_sub_epi8(v, _mm_or_si128(
+        m, _mm_or_si128(_mm_slli_epi32(m, 8), _mm_slli_epi32(m, 16))));
+    v = _mm_or_si128(v, _mm_slli_epi32(m, 24));
+    if (lpd) {
+      v = _mm_or_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(0x80));
+    }
+    _mm_storeu_si128((__m128i*) (out + 4*i), v);
+  }
+  return i;
+}
+#endif
+
+/* Four bytes per pixel: the values less the white common to all three, */
+/* then the white, each as 7 bits with the high bit set if lpd is set. */
+ENCODE_INLINE u32 encode_white(u8* out, pixel* pixels, u32 count,
+                               int o0, int o1, int o2, u8 lpd, u32 i) {
+  u8* s = (u8*) pixels;
+  u8* d;
+  u8 w;
+
+#if defined(ENCODE_NEON)
+  uint8x16_t high = vdupq_n_u8(0x80);
+  uint8x16x3_t rgb;
+  uint8x16x4_t v;
+  int k;
+
+  for (; encode_simd && count - i >= ENCODE_NEON_PIXELS;
+       i += ENCODE_NEON_PIXELS) {
+    rgb = vld3q_u8(s + 3*i);
+    v.val[3] = vminq_u8(vminq_u8(rgb.val[0], rgb.val[1]), rgb.val[2]);
+    v.val[0] = vsubq_u8(rgb.val[o0], v.val[3]);
+    v.val[1] = vsubq_u8(rgb.val[o1], v.val[3]);
+    v.val[2] = vsubq_u8(rgb.val[o2], v.val[3]);
+    for (k = 0; lpd && k < 4; k++) {
+      v.val[k] = vorrq_u8(vshrq_n_u8(v.val[k], 1), high);
+    }
+    vst4q_u8(out + 4*i, v);
+  }
+#endif
+  for (s += 3*i, d = out + 4*i; i < count; i++, s += 3, d += 4) {
+    w = s[0] < s[1] ? s[0] : s[1];
+    w = w < s[2] ? w : s[2];
+    if (lpd) {
+      d[0] = 0x80 | (s[o0] - w) >> 1;
+      d[1] = 0x80 | (s[o1] - w) >> 1;
+      d[2] = 0x80 | (s[o2] - w) >> 1;
+      d[3] = 0x80 | w >> 1;
+    } else {
+      d[0] = s[o0] - w;
+      d[1] = s[o1] - w;
+      d[2] = s[o2] - w;
+      d[3] = w;
+    }
+  }
+  return count*4;
+}
+
+/* Defines an encoder named encode_<name>_<order> for each color order, */
+/* in the order of order_t, by calling body with the order and arg fixed, */
+/* and on x86 an SSSE3 one named encode_<name>_<order>_ssse3 too. */
+#define ENCODE_KERNEL(name, order, body, o0, o1, o2, arg) \
+  static u32 encode_##name##_##order(u8* out, pixel* pixels, u32 count) { \
+    return body(out, pixels, count, o0, o1, o2, arg, 0); \
+  } \
+  ENCODE_SSSE3_KERNEL(name, order, body, o0, o1, o2, arg)
+#if defined(ENCODE_SSSE3)
+#define ENCODE_SSSE3_KERNEL(name, order, body, o0, o1, o2, arg) \
+  static ENCODE_SSSE3_TARGET u32 encode_##name##_##order##_ssse3( \
+      u8* out, pixel* pixels, u32 count) { \
+    return body(out, pixels, count, o0, o1, o2, arg, \
+                body##_ssse3(out, pixels, count, o0, o1, o2, arg)); \
+  }
+#else
+#define ENCODE_SSSE3_KERNEL(name, order, body, o0, o1, o2, arg)
+#endif
+#define ENCODE_KERNELS(name, body, arg) \
+  ENCODE_KERNEL(name, rgb, body, 0, 1, 2, arg) \
+  ENCODE_KERNEL(name, grb, body, 1, 0, 2, arg) \
+  ENCODE_KERNEL(name, bgr, body, 2, 1, 0, arg) \
+  ENCODE_KERNEL(name, rbg, body, 0, 2, 1, arg) \
+  ENCODE_KERNEL(name, gbr, body, 1, 2, 0, arg) \
+  ENCODE_KERNEL(name, brg, body, 2, 0, 1, arg)
+#define ENCODE_TABLE(name, suffix) { \
+  encode_##name##_rgb##suffix, encode_##name##_grb##suffix, \
+  encode_##name##_bgr##suffix, encode_##name##_rbg##suffix, \
+  encode_##name##_gbr##suffix, encode_##name##_brg##suffix}
+#define ENCODE_TABLES(suffix) { \
+  {ENCODE_TABLE(apa102, suffix), {NULL}}, \
+  {ENCODE_TABLE(tcl, suffix), {NULL}}, \
+  {ENCODE_TABLE(ws2801, suffix), ENCODE_TABLE(ws2801w, suffix)}, \
+  {ENCODE_TABLE(lpd8806, suffix), ENCODE_TABLE(lpd8806w, suffix)}}
+
+ENCODE_KERNELS(apa102, encode_quad, 0)
+ENCODE_KERNELS(tcl, encode_quad, 1)
+ENCODE_KERNELS(ws2801, encode_triple, 0)
+ENCODE_KERNELS(lpd8806, encode_triple, 1)
+ENCODE_KERNELS(ws2801w, encode_white, 0)
+ENCODE_KERNELS(lpd8806w, encode_white, 1)
+
+/* Indexed by chipset, then rgbw, then color order */
+typedef encode_func* encode_table[ENCODE_NUM_CHIPSETS][2][ENCODE_NUM_ORDERS];
+
+static encode_table encode_kernels = ENCODE_TABLES();
+#if defined(ENCODE_SSSE3)
+static encode_table encode_kernels_ssse3 = ENCODE_TABLES(_ssse3);
+#endif
+
+/* The kernels for this CPU, chosen on first use */
+static encode_table* encode_chosen = NULL;
+
+static char* encode_chipset_names[ENCODE_NUM_CHIPSETS] = {
+  "apa102", "tcl", "ws2801", "lpd8806"
+};
+
+static char* encode_order_names[ENCODE_NUM_ORDERS] = {
+  "rgb", "grb", "bgr", "rbg", "gbr", "brg"
+};
+
+encode_func* encode_get(chipset_t chipset, order_t order, u8 rgbw) {
+  if (chipset < 0 || chipset >= ENCODE_NUM_CHIPSETS ||
+      order < 0 || order >= ENCODE_NUM_ORDERS) {
+    return NULL;
+  }
+  if (!encode_chosen) {
+    encode_chosen = &encode_kernels;
+#if defined(ENCODE_SSSE3)
+    if (__builtin_cpu_supports("ssse3")) {
+      encode_chosen = &encode_kernels_ssse3;
+      encode_isa = "ssse3";
+    }
+#endif
+  }
+  return (*encode_chosen)[chipset][rgbw ? 1 : 0][order];
+}
+
+u8 encode_parse_chipset(char* name, chipset_t* chipset) {
+  int c;
+
+  for (c = 0; c < ENCODE_NUM_CHIPSETS; c++) {
+    if (!strcmp(name, encode_chipset_names[c])) {
+      *chipset = c;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+u8 encode_parse_order(char* name, order_t* order, u8* rgbw) {
+  int o;
+
+  for (o = 0; o < ENCODE_NUM_ORDERS; o++) {
+    if (!strncmp(name, encode_order_names[o], 3) &&
+        (name[3] == 0 || (name[3] == 'w' && name[4] == 0))) {
+      *order = o;
+      *rgbw = name[3] == 'w';
+      return 1;
+    }
+  }
+  return 0;
+}
+
+char* encode_order_name(order_t order) {
+  return order >= 0 && order < ENCODE_NUM_ORDERS ?
+      encode_order_names[order] : "?";
+}
@@ -0,0 +1,73 @@
+/* Copyright 2013 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// Encoders that turn RGB pixels into the wire format of each SPI chipset.
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include "types.h"
+
+/* The instruction set the encoders use: "ssse3", "neon", or "scalar". */
+/* On x86, the SSSE3 paths are always built and encode_get chooses them */
+/* if the CPU supports SSSE3 (this is set by then).  The NEON paths are */
+/* used where the compiler targets NEON (always on ARMv8; on ARMv7, with */
+/* -mfpu=neon). */
+extern char* encode_isa;
+
+/* Set to 0 to make the encoders use their scalar paths (for comparison). */
+extern u8 encode_simd;
+
+/* Supported chipsets */
+typedef enum { APA102=0, TCL=1, WS2801=2, LPD8806=3 } chipset_t;
+#define ENCODE_NUM_CHIPSETS 4
+
+/* The order in which a chipset expects the three color values. */
+typedef enum { RGB=0, GRB=1, BGR=2, RBG=3, GBR=4, BRG=5 } order_t;
+#define ENCODE_NUM_ORDERS 6
+
+/* Overall brightness level (0 to 31) sent with each APA102 pixel */
+#define ENCODE_APA102_LEVEL 31
+
+/* An encoder writes count pixels to out and returns the number of bytes */
+/* written; any start or end frame the chipset needs is up to the caller. */
+/* There is one for each chipset and color order, specialized at compile */
+/* time, so no encoder decides anything per pixel. */
+/*   APA102: a brightness byte (0xe0 plus ENCODE_APA102_LEVEL), then the */
+/*     three values (usually in BGR order). */
+/*   TCL (P9813): a flag byte made from the top two bits of each value, */
+/*     then the three values (usually in BGR order). */
+/*   WS2801: the three values. */
+/*   LPD8806: the three values as 7 bits each, with the high bit set. */
+/* The WS2801 and LPD8806 also have RGBW encoders for strips with a white */
+/* LED, which move the part of each pixel common to R, G and B into a */
+/* fourth (white) value after the other three. */
+typedef u32 encode_func(u8* out, pixel* pixels, u32 count);
+
+/* Returns the encoder for a chipset, color order, and RGB (rgbw = 0) or */
+/* RGBW (rgbw = 1) output, or NULL if there is no such encoder. */
+encode_func* encode_get(chipset_t chipset, order_t order, u8 rgbw);
+
+/* Parses a chipset name ("apa102", "tcl", "ws2801" or "lpd8806").  Returns */
+/* 1 and sets *chipset if the name is recognized, 0 otherwise. */
+u8 encode_parse_chipset(char* name, chipset_t* chipset);
+
+/* Parses a color order such as "grb", or "grbw" for RGBW output.  Returns */
+/* 1 and sets *order and *rgbw if the name is recognized, 0 otherwise. */
+u8 encode_parse_order(char* name, order_t* order, u8* rgbw);
+
+/* Returns the name of a color order, such as "grb". */
+char* encode_order_name(order_t order);
+
+/* Returns the number of bytes one pixel takes in an encoder's output. */
+#define ENCODE_PIXEL_SIZE(chipset, rgbw) \
+    ((rgbw) || (chipset) == APA102 || (chipset) == TCL ? 4 : 3)
+
+#endif /* ENCODE_H */
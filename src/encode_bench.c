@@ -0,0 +1,141 @@
+/* Copyright 2013 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// Times each chipset's pixel encoder with and without its vector path, and
+// checks that both paths produce the same bytes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "encode.h"
+#include "opc.h"
+
+char* chipset_names[] = {"apa102", "tcl", "ws2801", "lpd8806"};
+
+double now_us() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1e6 + t.tv_nsec*1e-3;
+}
+
+// Returns the average time in microseconds to encode one frame.
+double time_encode(encode_func* encode, u8* out, pixel* pixels, u32 count,
+                   int iterations) {
+  double start = now_us();
+  int i;
+
+  for (i = 0; i < iterations; i++) {
+    encode(out, pixels, count);
+  }
+  return (now_us() - start)/iterations;
+}
+
+void usage(char* prog_name) {
+  fprintf(stderr, "Usage: %s [-n <pixels>] [-i <iterations>] [-o <order>]\n",
+          prog_name);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  int count = 10000;
+  int iterations = 1000;
+  pixel* pixels;
+  u8* scalar_out;
+  u8* simd_out;
+  order_t order = GRB;
+  u8 rgbw;
+  encode_func* encode;
+  u32 length;
+  double scalar_us, simd_us;
+  int opt, chipset, o, i;
+
+  while ((opt = getopt(argc, argv, ":hn:i:o:")) != -1)
+  {
+      switch (opt)
+      {
+      case 'n':
+          count = atoi(optarg);
+          break;
+      case 'i':
+          iterations = atoi(optarg);
+          break;
+      case 'o':
+          if (!encode_parse_order(optarg, &order, &rgbw)) {
+            usage(argv[0]);
+          }
+          break;
+      case ':':
+          fprintf(stderr, "Missing argument to option: '%c'\n", optopt);
+          usage(argv[0]);
+      case '?':
+          fprintf(stderr, "Option not recognized: '%c'\n", optopt);
+          usage(argv[0]);
+      case 'h':
+      default:
+          usage(argv[0]);
+      }
+  }
+  if (optind != argc || count < 1 || count > OPC_MAX_PIXELS_PER_FRAME ||
+      iterations < 1) {
+      usage(argv[0]);
+  }
+
+  pixels = malloc(count*sizeof(pixel));
+  scalar_out = malloc(count*4);
+  simd_out = malloc(count*4);
+  for (i = 0; i < count; i++) {
+    pixels[i].r = rand();
+    pixels[i].g = rand();
+    pixels[i].b = rand();
+  }
+  // Check every encoder, then time each chipset in the chosen order.
+  for (chipset = 0; chipset < ENCODE_NUM_CHIPSETS; chipset++) {
+    for (rgbw = 0; rgbw < 2; rgbw++) {
+      for (o = 0; o < ENCODE_NUM_ORDERS; o++) {
+        if (!(encode = encode_get(chipset, o, rgbw))) {
+          continue;
+        }
+        encode_simd = 0;
+        length = encode(scalar_out, pixels, count);
+        encode_simd = 1;
+        if (encode(simd_out, pixels, count) != length ||
+            length != count*ENCODE_PIXEL_SIZE(chipset, rgbw) ||
+            memcmp(scalar_out, simd_out, length)) {
+          fprintf(stderr, "%s %s%s: vector and scalar output differ\n",
+                  chipset_names[chipset], encode_order_name(o),
+                  rgbw ? "w" : "");
+          return 1;
+        }
+      }
+    }
+  }
+  printf("%d pixels per frame, vector path: %s\n\n", count, encode_isa);
+  printf("%-8s %-5s %11s %11s %8s %12s\n", "chipset", "order",
+         "scalar us", "vector us", "speedup", "Mpixel/s");
+  for (chipset = 0; chipset < ENCODE_NUM_CHIPSETS; chipset++) {
+    for (rgbw = 0; rgbw < 2; rgbw++) {
+      if (!(encode = encode_get(chipset, order, rgbw))) {
+        continue;
+      }
+      encode_simd = 0;
+      scalar_us = time_encode(encode, scalar_out, pixels, count, iterations);
+      encode_simd = 1;
+      simd_us = time_encode(encode, simd_out, pixels, count, iterations);
+      printf("%-8s %-3s%-2s %11.1f %11.1f %7.1fx %12.1f\n",
+             chipset_names[chipset], encode_order_name(order),
+             rgbw ? "w" : "", scalar_us, simd_us, scalar_us/simd_us,
+             count/simd_us);
+    }
+  }
+  return 0;
+}
@@ -215,7 +215,7 @@ void keyboard(unsigned char key, int x, int y) {
   if (key == '\x1b' || key == 'q') exit(0);
 }
 
-void handler(u8 channel, u16 count, pixel* p) {
+void handler(u8 channel, u32 count, pixel* p) {
   int i = 0, j = 0, np = 0;
 
   if (verbose) {
@@ -461,7 +461,8 @@ int main(int argc, char** argv) {
   }
   init(layouts, num_channels);
   port = port ? port : OPC_DEFAULT_PORT;
-  source = opc_new_source(port);
+  source = opc_new_source_multi(port);
+  opc_set_coalescing(source, 1);
 
   glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
   glutCreateWindow("OPC");
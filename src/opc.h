@@ -22,18 +22,128 @@ specific language governing permissions and limitations under the License. */
 
 /* OPC command codes */
 #define OPC_SET_PIXELS 0
+#define OPC_SET_PIXEL_SPANS 1
+#define OPC_SET_PIXELS_16 2
+#define OPC_COMPRESSED 3
+#define OPC_SET_PIXELS_16_RGBW 4
+#define OPC_TIMED 5
 #define OPC_STREAM_SYNC 0xff
 
+/* OPC_SET_PIXELS_16 carries 16-bit R, G, B values (6 bytes per pixel) and */
+/* OPC_SET_PIXELS_16_RGBW 16-bit R, G, B, W values (8 bytes per pixel), */
+/* each value big-endian.  A source passes them to its 16-bit handler if */
+/* it has one (see opc_set_handler16), or else reduces them to 8-bit RGB */
+/* for the ordinary handler. */
+#define OPC_PIXEL16_LENGTH 6
+#define OPC_PIXEL16_RGBW_LENGTH 8
+
+/* An OPC_SET_PIXEL_SPANS message updates only part of a channel's frame. */
+/* Its payload is the pixel count of the whole frame, followed by any */
+/* number of spans, each an offset and a count of pixels followed by that */
+/* many RGB pixels.  All three numbers are 4 bytes, big-endian.  A source */
+/* keeps the last frame for each channel that has received spans, applies */
+/* each span to it, and passes the whole frame to the handler. */
+#define OPC_SPANS_HEADER_LENGTH 4
+#define OPC_SPAN_HEADER_LENGTH 8
+
+/* An OPC_COMPRESSED message wraps another message for the same channel. */
+/* Its payload is the wrapped command code, a codec number, the 4-byte */
+/* big-endian length of the wrapped payload, and then that payload as */
+/* compressed by the codec.  A source decompresses it and acts on the */
+/* wrapped message as if it had arrived directly. */
+#define OPC_COMPRESSED_HEADER_LENGTH 6
+
+/* An OPC_TIMED message wraps another message for the same channel that */
+/* should take effect at a given time.  Its payload is the wrapped command */
+/* code, the 8-byte big-endian presentation time (microseconds since the */
+/* Unix epoch, as given by opc_now_us), and then the wrapped payload.  A */
+/* source holds the wrapped message until that time; controllers whose */
+/* clocks are kept in step (e.g. by NTP or PTP) then show it together. */
+/* A time in the past, or more than OPC_MAX_SCHEDULE_US ahead, takes */
+/* effect at once. */
+#define OPC_TIMED_HEADER_LENGTH 9
+#define OPC_MAX_SCHEDULE_US 10000000
+
+/* Maximum number of timed messages a source holds; when it is full, the */
+/* earliest is acted on at once to make room */
+#define OPC_MAX_PENDING 64
+
+/* Codecs for OPC_COMPRESSED: run-length encoding of whole RGB pixels, and */
+/* an LZ77-family codec that writes LZ4 blocks */
+#define OPC_CODEC_NONE 0
+#define OPC_CODEC_RLE 1
+#define OPC_CODEC_LZ 2
+
+/* A long message has this bit set in its command code (other than */
+/* OPC_STREAM_SYNC) and a 16-bit length field of zero, followed by a */
+/* 32-bit big-endian length, so the header is 8 bytes instead of 4. */
+/* Both are needed: a message with a nonzero 16-bit length is short */
+/* whatever its command, so clients that use commands from 0x80 up keep */
+/* working, unless they send such commands with empty payloads. */
+/* opc_put_pixels uses this form only when a frame does not fit in the */
+/* short form, so servers that predate it are unaffected by short frames. */
+#define OPC_LONG_LENGTH 0x80
+#define OPC_SET_PIXELS_LONG (OPC_SET_PIXELS | OPC_LONG_LENGTH)
+
+/* These take a message header, of which at least 4 bytes must be present. */
+#define OPC_IS_LONG(header) \
+    ((header)[1] != OPC_STREAM_SYNC && ((header)[1] & OPC_LONG_LENGTH) && \
+     (header)[2] == 0 && (header)[3] == 0)
+#define OPC_COMMAND(header) \
+    (OPC_IS_LONG(header) ? (header)[1] & ~OPC_LONG_LENGTH : (header)[1])
+#define OPC_HEADER_LENGTH(header) (OPC_IS_LONG(header) ? 8 : 4)
+#define OPC_MAX_HEADER_LENGTH 8
+
+/* Payload length of a message, given at least OPC_HEADER_LENGTH bytes */
+#define OPC_PAYLOAD_LENGTH(header) (OPC_IS_LONG(header) ? \
+    ((u32) (header)[4] << 24 | (header)[5] << 16 | \
+     (header)[6] << 8 | (header)[7]) : \
+    ((u32) (header)[2] << 8 | (header)[3]))
+
+/* An OPC_STREAM_SYNC message marks the end of a frame that may span */
+/* several channels.  Once a connection has sent one, a source holds back */
+/* that connection's pixel data and delivers all the channels it updated */
+/* together when its next OPC_STREAM_SYNC arrives, so no frame is shown */
+/* half-updated.  Each connection's frame is held separately, so one */
+/* client's sync never shows another's half-sent frame.  Clients that */
+/* never send one are not affected.  (All the datagrams on a UDP source, */
+/* or messages in a shared-memory ring, count as one connection.) */
 #define OPC_STREAM_SYNC_LENGTH 4
 #define OPC_STREAM_SYNC_DATA ((u8*) "\xf0\xca\x71\x2e")
 
-/* Maximum number of OPC sinks or sources allowed */
+/* Maximum number of OPC sinks, sink groups, or sources allowed */
 #define OPC_MAX_SINKS 64
+#define OPC_MAX_GROUPS 16
 #define OPC_MAX_SOURCES 64
 
-/* Maximum number of pixels in one message */
+/* Maximum number of concurrent connections to a multi-connection source */
+#define OPC_MAX_CONNECTIONS 32
+
+/* Largest UDP payload that fits in an IPv4 datagram, and so the longest */
+/* message (header included) a UDP sink or source can carry */
+#define OPC_MAX_DATAGRAM_SIZE 65507
+
+/* Maximum number of pixels in one message with a 16-bit length */
 #define OPC_MAX_PIXELS_PER_MESSAGE ((1 << 16) / 3)
 
+/* Maximum number of pixels in one long message, and the largest payload */
+/* a source will accept (leaving room for a span or compression header */
+/* around a whole frame); longer messages cause the connection to be closed */
+#define OPC_MAX_PIXELS_PER_FRAME (1 << 18)
+#define OPC_MAX_PAYLOAD_LENGTH (OPC_MAX_PIXELS_PER_FRAME * 3 + 64)
+
+/* Maximum number of channels sent by one call to opc_put_pixels_batch */
+#define OPC_MAX_BATCH 256
+
+/* Recording files written by opc_new_sink_recording start with this */
+/* 8-byte magic string.  It is followed by one record per call that sent */
+/* data: an 8-byte timestamp (microseconds since the first record), a */
+/* 4-byte length, and then that many bytes of OPC messages exactly as they */
+/* would go on the wire.  Both numbers are big-endian, like OPC lengths. */
+#define OPC_RECORDING_MAGIC "OPCREC01"
+#define OPC_RECORDING_MAGIC_LENGTH 8
+#define OPC_RECORD_HEADER_LENGTH 12
+
 // OPC client functions ----------------------------------------------------
 
 /* Handle for an OPC sink created by opc_new_sink. */
@@ -44,43 +154,247 @@ typedef s8 opc_sink;
 /* opened as needed for sending, and reopened if it closes. */
 opc_sink opc_new_sink_socket(char* hostport);
 
+/* Creates a new OPC sink that sends each message as one UDP datagram. */
+/* hostport should be in "host" or "host:port" form.  Nothing is */
+/* retransmitted, so a lost datagram is a dropped frame rather than a */
+/* delay for every later frame.  A message must fit in one datagram */
+/* (OPC_MAX_DATAGRAM_SIZE bytes, i.e. at most 21834 pixels); a send that */
+/* includes a longer message is refused as a whole, with a message to */
+/* stderr, and returns 0. */
+opc_sink opc_new_sink_udp(char* hostport);
+
 /* Creates a new OPC sink.  path should be the path to a writeable file. */
 /* The file is not opened yet; the connection will be automatically opened */
 /* as needed for sending, and reopened if it closes. */
 opc_sink opc_new_sink_file(char* path);
 
+/* Creates a new OPC sink that records messages, with timestamps, into a */
+/* recording file (see OPC_RECORDING_MAGIC) that opc_replay can play back */
+/* at the original pacing.  The file is truncated when first opened and */
+/* appended to if it has to be reopened. */
+opc_sink opc_new_sink_recording(char* path);
+
+/* Creates a new OPC sink that writes messages into a shared-memory ring */
+/* read by an OPC source on the same host (see opc_new_source_shm).  name */
+/* is a POSIX shared memory name such as "/opc".  The ring is mapped as */
+/* needed for sending; if the ring is full, the message is dropped. */
+opc_sink opc_new_sink_shm(char* name);
+
 /* Calls opc_new_sink_socket.  Present for backward compatibility. */
 opc_sink opc_new_sink(char* hostport);
 
-/* Sends RGB data for 'count' pixels to channel 'channel'.  Makes one attempt */
+/* Makes a sink asynchronous.  From then on, opc_put_pixels, */
+/* opc_put_pixels_batch and opc_stream_sync copy their messages into a */
+/* queue of at most max_queued frames and return immediately; a background */
+/* thread connects and sends.  If the queue is full, the oldest queued */
+/* frame is dropped to make room.  Returns 1 on success, 0 on failure. */
+u8 opc_set_async(opc_sink sink, u16 max_queued);
+
+/* Returns the number of frames waiting to be sent on an asynchronous sink */
+/* (always 0 for a synchronous sink). */
+int opc_queue_depth(opc_sink sink);
+
+/* Returns the number of frames an asynchronous sink has dropped because */
+/* its queue was full. */
+u32 opc_queue_dropped(opc_sink sink);
+
+/* Sends 16-bit data for 'count' pixels to channel 'channel', including */
+/* the white values if rgbw is set (see OPC_SET_PIXELS_16).  At most */
+/* OPC_MAX_PAYLOAD_LENGTH/6 RGB or OPC_MAX_PAYLOAD_LENGTH/8 RGBW pixels */
+/* fit in one message.  Makes one attempt to connect the sink if needed. */
+/* Returns 1 if the data was sent (or queued), 0 otherwise. */
+u8 opc_put_pixels16(opc_sink sink, u8 channel, u32 count, pixel16* pixels,
+                    u8 rgbw);
+
+/* Makes a TCP, file or recording sink send only what has changed (or */
+/* stops doing so, if delta is 0).  Each frame passed to opc_put_pixels or */
+/* opc_put_pixels_batch is compared with the last one sent to the same */
+/* channel, and only the changed spans go out (see OPC_SET_PIXEL_SPANS), */
+/* so the receiving source must support that command.  The first frame */
+/* on each channel, and the first after the connection is reopened, is */
+/* sent whole.  A sink cannot be both delta and asynchronous, since a */
+/* dropped frame would corrupt the frames after it.  Returns 1 on */
+/* success, 0 on failure. */
+u8 opc_set_delta(opc_sink sink, u8 delta);
+
+/* Sets the codec (OPC_CODEC_RLE or OPC_CODEC_LZ) with which a sink */
+/* compresses the pixel data sent by opc_put_pixels and */
+/* opc_put_pixels_batch, or turns compression off with OPC_CODEC_NONE. */
+/* Each message is sent as OPC_COMPRESSED only if that makes it shorter, */
+/* so the receiving source must support that command.  Returns 1 on */
+/* success, 0 on failure. */
+u8 opc_set_compression(opc_sink sink, u8 codec);
+
+/* Sends RGB data for 'count' pixels to channel 'channel'.  More than */
+/* OPC_MAX_PIXELS_PER_MESSAGE pixels are sent as one long message (see */
+/* OPC_LONG_LENGTH), up to OPC_MAX_PIXELS_PER_FRAME.  Makes one attempt */
 /* to connect the sink if needed; if the connection could not be opened, the */
-/* the data is not sent.  Returns 1 if the data was sent, 0 otherwise. */
-u8 opc_put_pixels(opc_sink sink, u8 channel, u16 count, pixel* pixels);
+/* the data is not sent.  Returns 1 if the data was sent (or queued, for an */
+/* asynchronous sink), 0 otherwise. */
+u8 opc_put_pixels(opc_sink sink, u8 channel, u32 count, pixel* pixels);
+
+/* Pixel data for one channel, as passed to opc_put_pixels_batch. */
+typedef struct {
+  u8 channel;
+  u32 count;
+  pixel* pixels;
+} opc_channel_pixels;
+
+/* Sends RGB data for several channels, followed by a stream sync packet */
+/* if sync is nonzero, handing all the messages to the kernel in one */
+/* system call where possible.  Makes one attempt to connect the sink if */
+/* needed.  Returns 1 if everything was sent, 0 otherwise. */
+u8 opc_put_pixels_batch(opc_sink sink, int num_channels,
+                        opc_channel_pixels* channels, u8 sync);
+
+/* Sends a block of complete, already-encoded OPC messages (such as one */
+/* record from a recording file), preserving message boundaries.  Makes */
+/* one attempt to connect the sink if needed.  Returns 1 if the messages */
+/* were sent, 0 otherwise. */
+u8 opc_put_messages(opc_sink sink, u8* data, u32 length);
+
+/* Returns the current time on the clock used for presentation times: */
+/* microseconds since the Unix epoch. */
+u64 opc_now_us();
+
+/* Like opc_put_pixels, but the data is sent as an OPC_TIMED message to */
+/* be shown at time_us (see opc_now_us). */
+u8 opc_put_pixels_at(opc_sink sink, u8 channel, u32 count, pixel* pixels,
+                     u64 time_us);
+
+/* Like opc_put_pixels_batch, but every channel's data, and the stream */
+/* sync packet, is sent as an OPC_TIMED message to be shown at time_us */
+/* (see opc_now_us). */
+u8 opc_put_pixels_batch_at(opc_sink sink, int num_channels,
+                           opc_channel_pixels* channels, u8 sync,
+                           u64 time_us);
 
 /* Sends a stream sync packet to all channels.  Makes one attempt */
 /* to connect the sink if needed; if the connection could not be opened, the */
 /* the packet is not sent.  Returns 1 if the packet was sent, 0 otherwise. */
 u8 opc_stream_sync(opc_sink sink);
 
+/* Handle for a group of sinks created by opc_new_group. */
+typedef s8 opc_group;
+
+/* Outcome of delivering one frame to one member of a group. */
+typedef struct {
+  opc_sink sink;
+  u8 sent;  /* 1 if the whole message was sent (or queued), 0 otherwise */
+  u32 latency_us;  /* time from the start of the call until it was sent */
+} opc_delivery;
+
+/* Creates a new, empty group of sinks. */
+opc_group opc_new_group();
+
+/* Adds a sink to a group.  Returns 1 on success, 0 on failure. */
+u8 opc_group_add(opc_group group, opc_sink sink);
+
+/* Sends the same RGB data to every sink in a group.  The message is built */
+/* once; TCP sinks are connected (if needed) and written to concurrently */
+/* over non-blocking sockets, so the whole call takes about as long as the */
+/* slowest sink, bounded by the send timeout.  results must have room for */
+/* one entry per member and is filled in member order.  Returns the number */
+/* of sinks that received the data. */
+int opc_group_put_pixels(opc_group group, u8 channel, u32 count,
+                         pixel* pixels, opc_delivery* results);
+
 // OPC server functions ----------------------------------------------------
 
 /* Handle for an OPC source created by opc_new_source. */
 typedef s8 opc_source;
 
 /* Handler called by opc_receive when pixel data is received. */
-typedef void opc_handler(u8 channel, u16 count, pixel* pixels);
+typedef void opc_handler(u8 channel, u32 count, pixel* pixels);
+
+/* Handler called by opc_receive when 16-bit pixel data is received, if */
+/* one has been set for the source.  For RGB data, w is 0. */
+typedef void opc_handler16(u8 channel, u32 count, pixel16* pixels);
+
+/* Handler called by opc_receive after it has delivered all the channels */
+/* of a frame ended by an OPC_STREAM_SYNC message, if one has been set for */
+/* the source.  Drivers can use it to write out a whole frame at once. */
+typedef void opc_sync_handler();
 
 /* Creates a new OPC source by listening on the specified TCP port.  At most */
 /* one incoming connection is accepted at a time; if the connection closes, */
 /* the next call to opc_receive will begin listening for another connection. */
 opc_source opc_new_source(u16 port);
 
+/* Creates a new OPC source by listening on the specified TCP port.  Up to */
+/* OPC_MAX_CONNECTIONS incoming connections are accepted and serviced at */
+/* once, each with its own parse state, so several clients can drive the */
+/* same source.  Where epoll is unavailable, this behaves like */
+/* opc_new_source. */
+opc_source opc_new_source_multi(u16 port);
+
+/* Creates a new OPC source by binding to the specified UDP port.  Each */
+/* datagram must contain exactly one OPC message; malformed datagrams are */
+/* discarded, and a lost datagram simply means a lost frame. */
+opc_source opc_new_source_udp(u16 port);
+
+/* Creates a new OPC source that reads messages from a shared-memory ring, */
+/* creating the ring if necessary.  name is a POSIX shared memory name such */
+/* as "/opc".  The handler receives a pointer directly into the shared */
+/* slot, with no copying and no network stack involved. */
+opc_source opc_new_source_shm(char* name);
+
 /* Handles the next I/O event for a given OPC source; if incoming data is */
 /* received that completes a pixel data packet, calls the handler with the */
-/* pixel data.  Returns 1 if there was any I/O, 0 if the timeout expired. */
+/* pixel data.  Timed messages (see OPC_TIMED) that fall due are acted on */
+/* too, and the wait is cut short when one is due before the timeout. */
+/* Returns 1 if there was any I/O or a timed message was acted on, 0 if */
+/* the timeout expired. */
 u8 opc_receive(opc_source source, opc_handler* handler, u32 timeout_ms);
 
-/* Resets an OPC source to its initial state by closing the connection. */
+/* Enables or disables coalescing for an OPC source.  When enabled, and */
+/* several pixel data packets for the same channel have already arrived */
+/* together, opc_receive calls the handler only for the newest of them. */
+void opc_set_coalescing(opc_source source, u8 coalesce);
+
+/* Sets the handler that opc_receive calls for 16-bit pixel data on a */
+/* source, or NULL (the default) to pass such data to the ordinary */
+/* handler reduced to 8 bits, with any white added into R, G and B. */
+void opc_set_handler16(opc_source source, opc_handler16* handler16);
+
+/* Sets the handler that opc_receive calls at the end of each frame ended */
+/* by an OPC_STREAM_SYNC message, or NULL (the default) for none. */
+void opc_set_sync_handler(opc_source source, opc_sync_handler* sync_handler);
+
+/* Returns 1 if the pixel data being handled was held back until an */
+/* OPC_STREAM_SYNC, so the sync handler will be called once the rest of */
+/* the frame has been delivered; 0 if it should be shown on its own. */
+/* Call this from a handler. */
+u8 opc_is_staged(opc_source source);
+
+/* Counts kept for a source since it was created */
+typedef struct {
+  u64 messages;  /* messages received */
+  u64 bytes;  /* bytes received, including headers */
+  u64 dropped;  /* pixel messages skipped by coalescing, or malformed */
+} opc_stats;
+
+/* Copies the counts for a source into stats. */
+void opc_get_stats(opc_source source, opc_stats* stats);
+
+/* CLOCK_MONOTONIC times in nanoseconds for the message being handled: */
+/* when the source's socket (or ring) became readable, and when the read */
+/* that completed the message returned.  For a large TCP message read in */
+/* pieces, both refer to the last read.  Both are 0 for timed messages */
+/* released from the queue, and if timing is off. */
+typedef struct {
+  u64 readable_ns;
+  u64 complete_ns;
+} opc_times;
+
+/* Enables or disables recording of opc_times for a source (default off). */
+void opc_set_timing(opc_source source, u8 timing);
+
+/* Copies the times for the message being handled into times; call this */
+/* from a handler. */
+void opc_get_times(opc_source source, opc_times* times);
+
+/* Resets an OPC source to its initial state by closing all connections. */
 void opc_reset_source(opc_source source);
 
 #endif  /* OPC_H */
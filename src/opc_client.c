@@ -9,10 +9,14 @@ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
 CONDITIONS OF ANY KIND, either express or implied.  See the License for the
 specific language governing permissions and limitations under the License. */
 
+#define _GNU_SOURCE  /* for sendmmsg */
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,42 +25,135 @@ specific language governing permissions and limitations under the License. */
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include "codec.h"
 #include "opc.h"
+#include "shm.h"
 
 /* Wait at most 0.5 second for a connection or a write. */
 #define OPC_SEND_TIMEOUT_MS 1000
 
 #define OPC_SINK_TYPE_SOCKET 0
 #define OPC_SINK_TYPE_FILE 1
+#define OPC_SINK_TYPE_UDP 2
+#define OPC_SINK_TYPE_SHM 3
+#define OPC_SINK_TYPE_RECORDING 4
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  /* SO_NOSIGPIPE is set on the socket instead */
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Maximum number of datagrams handed to the kernel in one call. */
+#define OPC_MAX_DATAGRAMS 16
 
 #define OPC_MAX_PATH 1024
 
-/* Internal structure for a socket sink.  sock >= 0 iff connected. */
+/* Room for a message header followed by OPC_TIMED fields. */
+#define OPC_MAX_TIMED_HEADER_LENGTH \
+    (OPC_MAX_HEADER_LENGTH + OPC_TIMED_HEADER_LENGTH)
+
+/* Internal structure for a socket sink (TCP or UDP).  sock >= 0 iff */
+/* connected; for UDP, "connected" just means the socket has been created */
+/* and its default destination set. */
 typedef struct {
   struct sockaddr_in address;
   int sock;
   char address_string[64];
 } opc_sink_socket;
 
-/* Internal structure for a file sink.  fd >= 0 iff connected. */
+/* Internal structure for a file or recording sink.  fd >= 0 iff */
+/* connected.  For a recording, start is the time of the first record. */
 typedef struct {
   int fd;
+  u8 started;
+  struct timespec start;
   char path[OPC_MAX_PATH + 1];
 } opc_sink_file;
 
-/* Internal structure for a sink. */
+/* Internal structure for a shared-memory sink.  ring != NULL iff mapped. */
+typedef struct {
+  shm_ring* ring;
+  char name[OPC_MAX_PATH + 1];
+} opc_sink_shm;
+
+/* One queued frame: the OPC messages from one call, laid out back to */
+/* back exactly as they go on the wire. */
+typedef struct {
+  u8* data;
+  u32 length;
+  u32 capacity;
+} opc_frame;
+
+/* Send queue for an asynchronous sink.  Frames are queued in */
+/* frames[head..head + count) (modulo size) and sent by the thread; */
+/* sending holds the frame the thread is currently sending. */
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  u16 size;
+  u16 head;
+  u16 count;
+  u32 dropped;
+  opc_frame sending;
+  opc_frame* frames;
+} opc_sink_queue;
+
+/* Frames last sent by a delta sink.  previous[c] holds the last frame of */
+/* counts[c] pixels sent to channel c, which the server is known to have */
+/* only if valid[c] is set and epochs[c] matches the sink's epoch. */
+/* spans holds span payloads while they are being sent. */
+typedef struct {
+  pixel* previous[256];
+  u32 counts[256];
+  u32 epochs[256];
+  u8 valid[256];
+  opc_frame spans;
+} opc_sink_delta;
+
+/* Internal structure for a sink.  queue is NULL unless the sink is */
+/* asynchronous; delta is NULL unless it sends only changed spans.  epoch */
+/* counts the times the connection has been closed.  If codec is not */
+/* OPC_CODEC_NONE, packed holds compressed payloads while they are sent; */
+/* wide holds 16-bit pixel payloads while they are sent. */
 typedef struct {
   u8 type;
   union {
     opc_sink_socket socket;
     opc_sink_file file;
+    opc_sink_shm shm;
   } u;
+  opc_sink_queue* queue;
+  opc_sink_delta* delta;
+  u32 epoch;
+  u8 codec;
+  opc_frame packed;
+  opc_frame wide;
 } opc_sink_info;
 
 static opc_sink_info opc_sinks[OPC_MAX_SINKS];
 static opc_sink opc_next_sink = 0;
 
+/* Internal structure for a group of sinks. */
+typedef struct {
+  int num_sinks;
+  opc_sink sinks[OPC_MAX_SINKS];
+} opc_group_info;
+
+static opc_group_info opc_groups[OPC_MAX_GROUPS];
+static opc_group opc_next_group = 0;
+
+/* Progress of one group member during opc_group_put_pixels. */
+#define OPC_DELIVERY_DONE 0
+#define OPC_DELIVERY_CONNECTING 1
+#define OPC_DELIVERY_SENDING 2
+
 int opc_resolve(char* s, struct sockaddr_in* address, u16 default_port) {
   struct hostent* host;
   struct addrinfo* addr;
@@ -83,7 +180,8 @@ int opc_resolve(char* s, struct sockaddr_in* address, u16 default_port) {
   return 0;
 }
 
-opc_sink opc_new_sink_socket(char* hostport) {
+/* Allocates a socket sink of the given type for "host" or "host:port". */
+static opc_sink opc_new_sink_address(char* hostport, u8 type) {
   opc_sink_info* info;
   opc_sink_socket* ss;
 
@@ -93,7 +191,10 @@ opc_sink opc_new_sink_socket(char* hostport) {
     return -1;
   }
   info = &opc_sinks[opc_next_sink];
-  info->type = OPC_SINK_TYPE_SOCKET;
+  info->type = type;
+  info->queue = NULL;
+  info->delta = NULL;
+  info->codec = OPC_CODEC_NONE;
   ss = &(info->u.socket);
   ss->sock = -1;
 
@@ -110,7 +211,16 @@ opc_sink opc_new_sink_socket(char* hostport) {
   return opc_next_sink++;
 }
 
-opc_sink opc_new_sink_file(char* path) {
+opc_sink opc_new_sink_socket(char* hostport) {
+  return opc_new_sink_address(hostport, OPC_SINK_TYPE_SOCKET);
+}
+
+opc_sink opc_new_sink_udp(char* hostport) {
+  return opc_new_sink_address(hostport, OPC_SINK_TYPE_UDP);
+}
+
+/* Allocates a file sink of the given type for the given path. */
+static opc_sink opc_new_sink_path(char* path, u8 type) {
   opc_sink_info* info;
   opc_sink_file* sf;
 
@@ -125,40 +235,122 @@ opc_sink opc_new_sink_file(char* path) {
     return -1;
   }
   info = &opc_sinks[opc_next_sink];
-  info->type = OPC_SINK_TYPE_FILE;
+  info->type = type;
+  info->queue = NULL;
+  info->delta = NULL;
+  info->codec = OPC_CODEC_NONE;
   sf = &(info->u.file);
   sf->fd = -1;
+  sf->started = 0;
   strcpy(sf->path, path);
 
   /* Increment opc_next_sink only if we were successful. */
   return opc_next_sink++;
 }
 
+opc_sink opc_new_sink_file(char* path) {
+  return opc_new_sink_path(path, OPC_SINK_TYPE_FILE);
+}
+
+opc_sink opc_new_sink_recording(char* path) {
+  return opc_new_sink_path(path, OPC_SINK_TYPE_RECORDING);
+}
+
+opc_sink opc_new_sink_shm(char* name) {
+  opc_sink_info* info;
+  opc_sink_shm* sm;
+
+  if (strlen(name) > OPC_MAX_PATH) {
+    fprintf(stderr, "OPC: Name is too long (max %d chars)\n", OPC_MAX_PATH);
+    return -1;
+  }
+
+  /* Allocate an opc_sink_info entry. */
+  if (opc_next_sink >= OPC_MAX_SINKS) {
+    fprintf(stderr, "OPC: No more sinks available\n");
+    return -1;
+  }
+  info = &opc_sinks[opc_next_sink];
+  info->type = OPC_SINK_TYPE_SHM;
+  info->queue = NULL;
+  info->delta = NULL;
+  info->codec = OPC_CODEC_NONE;
+  sm = &(info->u.shm);
+  sm->ring = NULL;
+  strcpy(sm->name, name);
+
+  /* Increment opc_next_sink only if we were successful. */
+  return opc_next_sink++;
+}
+
 /* Backward compatibility. */
 opc_sink opc_new_sink(char* hostport) {
   return opc_new_sink_socket(hostport);
 }
 
+/* Starts a non-blocking connect for a socket sink.  Returns the new */
+/* socket, or -1 if the attempt failed immediately. */
+static int opc_start_connect(opc_sink_socket* ss) {
+  int sock;
+
+  sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  fcntl(sock, F_SETFL, O_NONBLOCK);
+  if (connect(sock, (struct sockaddr*) &(ss->address),
+              sizeof(ss->address)) < 0 && errno != EINPROGRESS) {
+    fprintf(stderr, "OPC: Failed to connect to %s: ", ss->address_string);
+    perror(NULL);
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* Completes a connect begun by opc_start_connect, once the socket has */
+/* become writable.  On success, stores the socket in ss and returns 0; */
+/* otherwise closes the socket and returns the error from the connect. */
+static int opc_finish_connect(opc_sink_socket* ss, int sock, u32 timeout_ms) {
+  struct timeval timeout;
+  int opt_errno = 0;
+  socklen_t len = sizeof(opt_errno);
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+#endif
+
+  getsockopt(sock, SOL_SOCKET, SO_ERROR, &opt_errno, &len);
+  if (opt_errno != 0) {
+    fprintf(stderr, "OPC: Failed to connect to %s: %s\n",
+            ss->address_string, strerror(opt_errno));
+    close(sock);
+    return opt_errno;
+  }
+
+  /* Go back to blocking sends, bounded by the send timeout, which only */
+  /* needs to be set once per connection. */
+  fcntl(sock, F_SETFL, 0);
+  timeout.tv_sec = timeout_ms/1000;
+  timeout.tv_usec = (timeout_ms % 1000)*1000;
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+  setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+  fprintf(stderr, "OPC: Connected to %s\n", ss->address_string);
+  ss->sock = sock;
+  return 0;
+}
+
 /* Makes one attempt to connect a socket sink, returning 1 on success. */
 static u8 opc_connect_socket(opc_sink_socket* ss, u32 timeout_ms) {
   int sock;
   struct timeval timeout;
   fd_set writefds;
-  int opt_errno;
-  socklen_t len;
 
   if (ss->sock >= 0) {  /* already connected */
     return 1;
   }
 
   /* Do a non-blocking connect so we can control the timeout. */
-  sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-  fcntl(sock, F_SETFL, O_NONBLOCK);
-  if (connect(sock, (struct sockaddr*) &(ss->address),
-              sizeof(ss->address)) < 0 && errno != EINPROGRESS) {
-    fprintf(stderr, "OPC: Failed to connect to %s: ", ss->address_string);
-    perror(NULL);
-    close(sock);
+  sock = opc_start_connect(ss);
+  if (sock < 0) {
     return 0;
   }
 
@@ -166,40 +358,65 @@ static u8 opc_connect_socket(opc_sink_socket* ss, u32 timeout_ms) {
   FD_ZERO(&writefds);
   FD_SET(sock, &writefds);
   timeout.tv_sec = timeout_ms/1000;
-  timeout.tv_usec = timeout_ms % 1000;
+  timeout.tv_usec = (timeout_ms % 1000)*1000;
   select(sock + 1, NULL, &writefds, NULL, &timeout);
   if (FD_ISSET(sock, &writefds)) {
-    opt_errno = 0;
-    getsockopt(sock, SOL_SOCKET, SO_ERROR, &opt_errno, &len);
-    if (opt_errno == 0) {
-      fprintf(stderr, "OPC: Connected to %s\n", ss->address_string);
-      ss->sock = sock;
-      return 1;
-    } else {
-      fprintf(stderr, "OPC: Failed to connect to %s: %s\n",
-              ss->address_string, strerror(opt_errno));
-      close(sock);
-      if (opt_errno == ECONNREFUSED) {
-        usleep(timeout_ms*1000);
-      }
-      return 0;
+    if (opc_finish_connect(ss, sock, timeout_ms) == ECONNREFUSED) {
+      usleep(timeout_ms*1000);
     }
+    return ss->sock >= 0;
   }
   fprintf(stderr, "OPC: No connection to %s after %d ms\n",
           ss->address_string, timeout_ms);
+  close(sock);
   return 0;
 }
 
-/* Makes one attempt to open a file sink, returning 1 on success. */
-static u8 opc_open_file(opc_sink_file* sf) {
+/* Creates the datagram socket for a UDP sink, returning 1 on success. */
+static u8 opc_connect_udp(opc_sink_socket* ss) {
+  int sock;
+
+  if (ss->sock >= 0) {  /* already connected */
+    return 1;
+  }
+  sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock < 0 || connect(sock, (struct sockaddr*) &(ss->address),
+                          sizeof(ss->address)) < 0) {
+    fprintf(stderr, "OPC: Failed to open UDP socket to %s: ",
+            ss->address_string);
+    perror(NULL);
+    if (sock >= 0) close(sock);
+    return 0;
+  }
+  fprintf(stderr, "OPC: Sending UDP to %s\n", ss->address_string);
+  ss->sock = sock;
+  return 1;
+}
+
+/* Makes one attempt to open a file sink, returning 1 on success.  A */
+/* recording is truncated and given its magic string the first time. */
+static u8 opc_open_file(opc_sink_file* sf, u8 recording) {
   int fd;
 
   /* Open the file */
-  fd = open(sf->path, O_CREAT | O_WRONLY | O_APPEND, 0644);
+  if (recording && !sf->started) {
+    fd = open(sf->path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd >= 0 && write(fd, OPC_RECORDING_MAGIC, OPC_RECORDING_MAGIC_LENGTH)
+        != OPC_RECORDING_MAGIC_LENGTH) {
+      close(fd);
+      fd = -1;
+    }
+  } else {
+    fd = open(sf->path, O_CREAT | O_WRONLY | O_APPEND, 0644);
+  }
   if (fd < 0) {
-    fprintf(stderr, "OPC: %s: %s", sf->path, strerror(errno));
+    fprintf(stderr, "OPC: %s: %s\n", sf->path, strerror(errno));
     return 0;
   }
+  if (recording && !sf->started) {
+    clock_gettime(CLOCK_MONOTONIC, &sf->start);
+    sf->started = 1;
+  }
   sf->fd = fd;
   return 1;
 }
@@ -214,6 +431,7 @@ static void opc_close(opc_sink sink) {
   }
   switch (info->type) {
     case OPC_SINK_TYPE_SOCKET:
+    case OPC_SINK_TYPE_UDP:
       if (info->u.socket.sock >= 0) {
         close(info->u.socket.sock);
         info->u.socket.sock = -1;
@@ -222,15 +440,24 @@ static void opc_close(opc_sink sink) {
       }
       break;
     case OPC_SINK_TYPE_FILE:
+    case OPC_SINK_TYPE_RECORDING:
       if (info->u.file.fd >= 0) {
         close(info->u.file.fd);
         info->u.file.fd = -1;
         fprintf(stderr, "OPC: Closed %s\n", info->u.file.path);
       }
       break;
+    case OPC_SINK_TYPE_SHM:
+      if (info->u.shm.ring) {
+        shm_unmap(info->u.shm.ring);
+        info->u.shm.ring = NULL;
+        fprintf(stderr, "OPC: Closed %s\n", info->u.shm.name);
+      }
+      break;
     default:
       fprintf(stderr, "OPC: Unknown sink type %d\n", info->type);
   }
+  info->epoch++;
 }
 
 /* Makes one attempt to open the connection for a sink if needed, timing out */
@@ -245,80 +472,199 @@ static u8 opc_connect(opc_sink sink, u32 timeout_ms) {
   switch (info->type) {
     case OPC_SINK_TYPE_SOCKET:
       return opc_connect_socket(&(info->u.socket), timeout_ms);
+    case OPC_SINK_TYPE_UDP:
+      return opc_connect_udp(&(info->u.socket));
     case OPC_SINK_TYPE_FILE:
-      return opc_open_file(&(info->u.file));
+      return opc_open_file(&(info->u.file), 0);
+    case OPC_SINK_TYPE_RECORDING:
+      return opc_open_file(&(info->u.file), 1);
+    case OPC_SINK_TYPE_SHM:
+      if (!info->u.shm.ring) {
+        info->u.shm.ring = shm_map(info->u.shm.name, 0);
+      }
+      return info->u.shm.ring != NULL;
     default:
       fprintf(stderr, "OPC: Unknown sink type %d\n", info->type);
       return 0;
   }
 }
 
-/* Sends data to a socket sink, making at most one attempt to open the */
-/* connection if needed and waiting at most timeout_ms for each I/O */
-/* operation.  Returns 1 if all the data was sent, 0 otherwise. */
-static u8 opc_send_socket(
-    opc_sink_socket* ss, const u8* data, ssize_t len, u32 timeout_ms) {
-  struct timeval timeout;
-  ssize_t total_sent = 0;
+/* Advances an iovec array past n bytes that have already been written, */
+/* adjusting the first remaining iovec.  Returns the number remaining. */
+static int opc_skip_iov(struct iovec** iov, int iovcnt, size_t n) {
+  while (iovcnt > 0 && n >= (*iov)->iov_len) {
+    n -= (*iov)->iov_len;
+    (*iov)++;
+    iovcnt--;
+  }
+  if (iovcnt > 0) {
+    (*iov)->iov_base = (u8*) (*iov)->iov_base + n;
+    (*iov)->iov_len -= n;
+  }
+  return iovcnt;
+}
+
+/* Sends the data in an iovec array to a connected socket sink, using one */
+/* sendmsg call unless the kernel accepts only part of it.  Each call waits */
+/* at most the send timeout set on the socket.  Modifies iov.  Returns 1 */
+/* if all the data was sent, 0 otherwise. */
+static u8 opc_send_socket(opc_sink_socket* ss, struct iovec* iov, int iovcnt) {
+  struct msghdr msg;
   ssize_t sent;
-  sig_t pipe_sig;
 
-  timeout.tv_sec = timeout_ms/1000;
-  timeout.tv_usec = timeout_ms % 1000;
-  setsockopt(ss->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-  while (total_sent < len) {
-    pipe_sig = signal(SIGPIPE, SIG_IGN);
-    sent = send(ss->sock, data + total_sent, len - total_sent, 0);
-    signal(SIGPIPE, pipe_sig);
+  while (iovcnt > 0) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+    sent = sendmsg(ss->sock, &msg, MSG_NOSIGNAL);
     if (sent <= 0) {
       perror("OPC: Error sending data");
       return 0;
     }
-    total_sent += sent;
+    iovcnt = opc_skip_iov(&iov, iovcnt, sent);
+  }
+  return 1;
+}
+
+/* Returns 1 if every message in a batch for a UDP sink fits in one */
+/* datagram; otherwise reports the first that does not and returns 0, */
+/* since the kernel would only refuse it with EMSGSIZE. */
+static u8 opc_check_datagrams(struct iovec* iov, int count) {
+  u32 length;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    length = iov[2*i].iov_len + iov[2*i + 1].iov_len;
+    if (length > OPC_MAX_DATAGRAM_SIZE) {
+      fprintf(stderr, "OPC: Message too long for a datagram (%u > %d bytes)\n",
+              length, OPC_MAX_DATAGRAM_SIZE);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Sends a batch of messages to a UDP sink, one datagram per message.  */
+/* Message i is made of the iovecs iov[2*i] (header) and iov[2*i + 1] */
+/* (payload).  Returns 1 if every datagram was handed to the kernel. */
+static u8 opc_send_datagrams(opc_sink_socket* ss, struct iovec* iov, int count) {
+  int sent = 0;
+  int i;
+#ifdef __linux__
+  struct mmsghdr msgs[OPC_MAX_DATAGRAMS];
+  int n;
+
+  while (sent < count) {
+    n = count - sent < OPC_MAX_DATAGRAMS ? count - sent : OPC_MAX_DATAGRAMS;
+    memset(msgs, 0, n*sizeof(struct mmsghdr));
+    for (i = 0; i < n; i++) {
+      msgs[i].msg_hdr.msg_iov = iov + 2*(sent + i);
+      msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+    n = sendmmsg(ss->sock, msgs, n, 0);
+    if (n <= 0) {
+      perror("OPC: Error sending datagrams");
+      return 0;
+    }
+    sent += n;
+  }
+#else
+  struct msghdr msg;
+
+  for (; sent < count; sent++) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov + 2*sent;
+    msg.msg_iovlen = 2;
+    if (sendmsg(ss->sock, &msg, 0) < 0) {
+      perror("OPC: Error sending datagram");
+      return 0;
+    }
   }
+#endif
   return 1;
 }
 
-/* Writes data to a file sink, returning 1 if all the data was written. */
-static u8 opc_write_file(opc_sink_file* sf, const u8* data, ssize_t len) {
-  ssize_t total_sent = 0;
+/* Writes the data in an iovec array to a file sink.  Modifies iov. */
+/* Returns 1 if all the data was written, 0 otherwise. */
+static u8 opc_write_file(opc_sink_file* sf, struct iovec* iov, int iovcnt) {
   ssize_t sent;
   sig_t pipe_sig;
 
-  while (total_sent < len) {
-    pipe_sig = signal(SIGPIPE, SIG_IGN);
-    sent = write(sf->fd, data + total_sent, len - total_sent);
-    signal(SIGPIPE, pipe_sig);
+  pipe_sig = signal(SIGPIPE, SIG_IGN);
+  while (iovcnt > 0) {
+    sent = writev(sf->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
     if (sent <= 0) {
       perror("OPC: Error writing data");
-      return 0;
+      break;
     }
-    total_sent += sent;
+    iovcnt = opc_skip_iov(&iov, iovcnt, sent);
   }
-  return 1;
+  signal(SIGPIPE, pipe_sig);
+  return iovcnt == 0;
 }
 
-/* Sends data to a sink, making at most one attempt to open the connection */
-/* if needed and waiting at most timeout_ms for each I/O operation.  Returns */
-/* 1 if all the data was sent, 0 otherwise. */
-static u8 opc_send(opc_sink sink, const u8* data, ssize_t len, u32 timeout_ms) {
-  opc_sink_info* info = &opc_sinks[sink];
-  int result = 0;
+/* Writes the data in an iovec array to a recording sink as one record, */
+/* stamped with the time since the first record.  Returns 1 if the whole */
+/* record was written, 0 otherwise. */
+static u8 opc_write_record(opc_sink_file* sf, struct iovec* iov, int iovcnt) {
+  struct iovec record[1 + 2*(OPC_MAX_BATCH + 1)];
+  u8 header[OPC_RECORD_HEADER_LENGTH];
+  struct timespec now;
+  u64 time_us;
+  u32 length = 0;
+  int i;
 
-  if (sink < 0 || sink >= opc_next_sink) {
-    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+  if (iovcnt > 2*(OPC_MAX_BATCH + 1)) {
+    fprintf(stderr, "OPC: Too many messages for one record\n");
     return 0;
   }
-  if (!opc_connect(sink, timeout_ms)) {
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  time_us = (u64) (now.tv_sec - sf->start.tv_sec)*1000000 +
+      (now.tv_nsec - sf->start.tv_nsec)/1000;
+  for (i = 0; i < iovcnt; i++) {
+    record[1 + i] = iov[i];
+    length += iov[i].iov_len;
+  }
+  for (i = 0; i < 8; i++) {
+    header[i] = time_us >> (56 - 8*i);
+  }
+  for (i = 0; i < 4; i++) {
+    header[8 + i] = length >> (24 - 8*i);
+  }
+  record[0].iov_base = header;
+  record[0].iov_len = OPC_RECORD_HEADER_LENGTH;
+  return opc_write_file(sf, record, 1 + iovcnt);
+}
+
+/* Sends a batch of OPC messages to a sink right away, making at most one */
+/* attempt to open the connection if needed.  Message i is made of the iovecs */
+/* iov[2*i] (header) and iov[2*i + 1] (payload); a socket or file sink gets */
+/* the whole batch in as few system calls as possible, a UDP sink gets one */
+/* datagram per message, and a shared-memory sink gets one slot per */
+/* message.  Returns 1 if everything was sent. */
+static u8 opc_send_messages_now(opc_sink sink, struct iovec* iov, int count) {
+  opc_sink_info* info = &opc_sinks[sink];
+  u8 result = 0;
+
+  if (!opc_connect(sink, OPC_SEND_TIMEOUT_MS)) {
     return 0;
   }
   switch (info->type) {
     case OPC_SINK_TYPE_SOCKET:
-      result = opc_send_socket(&(info->u.socket), data, len, timeout_ms);
+      result = opc_send_socket(&(info->u.socket), iov, 2*count);
+      break;
+    case OPC_SINK_TYPE_UDP:
+      result = opc_send_datagrams(&(info->u.socket), iov, count);
       break;
     case OPC_SINK_TYPE_FILE:
-      result = opc_write_file(&(info->u.file), data, len);
+      result = opc_write_file(&(info->u.file), iov, 2*count);
+      break;
+    case OPC_SINK_TYPE_RECORDING:
+      result = opc_write_record(&(info->u.file), iov, 2*count);
       break;
+    case OPC_SINK_TYPE_SHM:
+      /* A full ring just drops messages; the mapping stays usable. */
+      return shm_put(info->u.shm.ring, iov, count);
     default:
       fprintf(stderr, "OPC: Unknown sink type %d\n", info->type);
       return 0;
@@ -328,33 +674,815 @@ static u8 opc_send(opc_sink sink, const u8* data, ssize_t len, u32 timeout_ms) {
   return result;
 }
 
-u8 opc_send_header(opc_sink sink, u8 channel, u8 command, u16 len) {
-  u8 header[4];
+/* Describes a block of complete OPC messages as iovec pairs in the form */
+/* taken by opc_send_messages.  Returns the number of messages, or -1 if */
+/* the block does not end on a message boundary or holds more than */
+/* max_count messages. */
+static int opc_split_messages(
+    u8* data, u32 length, struct iovec* iov, int max_count) {
+  u32 offset;
+  u32 header_length;
+  u32 len;
+  int count;
+
+  for (offset = 0, count = 0; offset < length; count++) {
+    if (count == max_count || length - offset < 4) {
+      return -1;
+    }
+    header_length = OPC_HEADER_LENGTH(data + offset);
+    if (length - offset < header_length) {
+      return -1;
+    }
+    len = OPC_PAYLOAD_LENGTH(data + offset);
+    if (length - offset - header_length < len) {
+      return -1;
+    }
+    iov[2*count].iov_base = data + offset;
+    iov[2*count].iov_len = header_length;
+    iov[2*count + 1].iov_base = data + offset + header_length;
+    iov[2*count + 1].iov_len = len;
+    offset += header_length + len;
+  }
+  return count;
+}
+
+/* Background thread for an asynchronous sink: sends queued frames in */
+/* order, one frame at a time, for as long as the program runs. */
+static void* opc_sink_thread(void* arg) {
+  opc_sink sink = (opc_sink) (long) arg;
+  opc_sink_queue* q = opc_sinks[sink].queue;
+  struct iovec iov[2*(OPC_MAX_BATCH + 1)];
+  opc_frame frame;
+  int count;
+
+  pthread_mutex_lock(&q->lock);
+  while (1) {
+    while (q->count == 0) {
+      pthread_cond_wait(&q->ready, &q->lock);
+    }
+
+    /* Take the oldest frame, leaving our spare buffer in its place. */
+    frame = q->frames[q->head];
+    q->frames[q->head] = q->sending;
+    q->sending = frame;
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    pthread_mutex_unlock(&q->lock);
+
+    /* Split the frame back into messages and send them. */
+    count = opc_split_messages(
+        frame.data, frame.length, iov, OPC_MAX_BATCH + 1);
+    opc_send_messages_now(sink, iov, count);
+    pthread_mutex_lock(&q->lock);
+  }
+  return NULL;
+}
+
+/* Copies a batch of messages into the next free frame of a sink's queue, */
+/* dropping the oldest queued frame if the queue is full. */
+static u8 opc_enqueue(opc_sink_queue* q, struct iovec* iov, int count) {
+  opc_frame* frame;
+  u32 length = 0;
+  u8* data;
+  int i;
+
+  for (i = 0; i < 2*count; i++) {
+    length += iov[i].iov_len;
+  }
+  pthread_mutex_lock(&q->lock);
+  if (q->count == q->size) {
+    q->head = (q->head + 1) % q->size;
+    q->count--;
+    q->dropped++;
+  }
+  frame = &q->frames[(q->head + q->count) % q->size];
+  if (frame->capacity < length) {
+    data = realloc(frame->data, length);
+    if (!data) {
+      pthread_mutex_unlock(&q->lock);
+      fprintf(stderr, "OPC: Out of memory for queued frame\n");
+      return 0;
+    }
+    frame->data = data;
+    frame->capacity = length;
+  }
+  for (i = 0, frame->length = 0; i < 2*count; i++) {
+    memcpy(frame->data + frame->length, iov[i].iov_base, iov[i].iov_len);
+    frame->length += iov[i].iov_len;
+  }
+  q->count++;
+  pthread_cond_signal(&q->ready);
+  pthread_mutex_unlock(&q->lock);
+  return 1;
+}
+
+/* Sends a batch of OPC messages to a sink, laid out as described for */
+/* opc_send_messages_now.  For an asynchronous sink, the messages are */
+/* only queued; returns 1 if they were sent (or queued), 0 otherwise. */
+static u8 opc_send_messages(opc_sink sink, struct iovec* iov, int count) {
+  if (sink < 0 || sink >= opc_next_sink) {
+    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+    return 0;
+  }
+  if (opc_sinks[sink].type == OPC_SINK_TYPE_UDP &&
+      !opc_check_datagrams(iov, count)) {
+    return 0;
+  }
+  if (opc_sinks[sink].queue) {
+    return opc_enqueue(opc_sinks[sink].queue, iov, count);
+  }
+  return opc_send_messages_now(sink, iov, count);
+}
+
+u8 opc_set_async(opc_sink sink, u16 max_queued) {
+  opc_sink_queue* q;
+
+  if (sink < 0 || sink >= opc_next_sink) {
+    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+    return 0;
+  }
+  if (opc_sinks[sink].queue) {
+    fprintf(stderr, "OPC: Sink %d is already asynchronous\n", sink);
+    return 0;
+  }
+  if (opc_sinks[sink].delta) {
+    fprintf(stderr, "OPC: Sink %d sends deltas and cannot be asynchronous\n",
+            sink);
+    return 0;
+  }
+  if (max_queued < 1) {
+    max_queued = 1;
+  }
+  q = calloc(1, sizeof(opc_sink_queue));
+  if (q) {
+    q->frames = calloc(max_queued, sizeof(opc_frame));
+  }
+  if (!q || !q->frames) {
+    fprintf(stderr, "OPC: Out of memory for send queue\n");
+    free(q);
+    return 0;
+  }
+  q->size = max_queued;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->ready, NULL);
+  opc_sinks[sink].queue = q;
+  if (pthread_create(&q->thread, NULL, opc_sink_thread, (void*) (long) sink)) {
+    fprintf(stderr, "OPC: Could not start send thread\n");
+    opc_sinks[sink].queue = NULL;
+    free(q->frames);
+    free(q);
+    return 0;
+  }
+  pthread_detach(q->thread);
+  return 1;
+}
+
+int opc_queue_depth(opc_sink sink) {
+  opc_sink_queue* q;
+  int depth;
+
+  if (sink < 0 || sink >= opc_next_sink || !opc_sinks[sink].queue) {
+    return 0;
+  }
+  q = opc_sinks[sink].queue;
+  pthread_mutex_lock(&q->lock);
+  depth = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return depth;
+}
+
+u32 opc_queue_dropped(opc_sink sink) {
+  opc_sink_queue* q;
+  u32 dropped;
+
+  if (sink < 0 || sink >= opc_next_sink || !opc_sinks[sink].queue) {
+    return 0;
+  }
+  q = opc_sinks[sink].queue;
+  pthread_mutex_lock(&q->lock);
+  dropped = q->dropped;
+  pthread_mutex_unlock(&q->lock);
+  return dropped;
+}
 
+/* Fills in a message header, which must have room for */
+/* OPC_MAX_HEADER_LENGTH bytes; the long form is used only if len does */
+/* not fit in 16 bits.  Returns the length of the header. */
+static u32 opc_set_header(u8* header, u8 channel, u8 command, u32 len) {
   header[0] = channel;
-  header[1] = command;
-  header[2] = len >> 8;
-  header[3] = len & 0xff;
-  return opc_send(sink, header, 4, OPC_SEND_TIMEOUT_MS);
+  if (len > 0xffff) {
+    header[1] = command | OPC_LONG_LENGTH;
+    header[2] = header[3] = 0;
+    header[4] = len >> 24;
+    header[5] = (len >> 16) & 0xff;
+    header[6] = (len >> 8) & 0xff;
+    header[7] = len & 0xff;
+  } else {
+    header[1] = command;
+    header[2] = len >> 8;
+    header[3] = len & 0xff;
+  }
+  return OPC_HEADER_LENGTH(header);
 }
 
-u8 opc_put_pixels(opc_sink sink, u8 channel, u16 count, pixel* pixels) {
-  ssize_t len;
+/* Fills in a message header and the pair of iovecs that describe the */
+/* message for opc_send_messages. */
+static void opc_set_message(struct iovec* iov, u8* header, u8 channel,
+                            u8 command, const u8* data, u32 len) {
+  iov[0].iov_base = header;
+  iov[0].iov_len = opc_set_header(header, channel, command, len);
+  iov[1].iov_base = (void*) data;
+  iov[1].iov_len = len;
+}
 
-  if (count > 0xffff / 3) {
-    fprintf(stderr, "OPC: Maximum pixel count exceeded (%d > %d)\n",
-            count, 0xffff / 3);
+/* Turns the message described by iov (whose header is header) into an */
+/* OPC_TIMED message wrapping it.  The timing fields are appended to the */
+/* header, which must have room for OPC_MAX_TIMED_HEADER_LENGTH bytes, so */
+/* the payload is left where it is. */
+static void opc_time_message(struct iovec* iov, u8* header, u64 time_us) {
+  u8 command = OPC_COMMAND(header);
+  u32 length;
+  int i;
+
+  length = opc_set_header(header, header[0], OPC_TIMED,
+                          OPC_TIMED_HEADER_LENGTH + iov[1].iov_len);
+  header[length] = command;
+  for (i = 0; i < 8; i++) {
+    header[length + 1 + i] = time_us >> (56 - 8*i);
   }
-  len = count * 3;
+  iov[0].iov_len = length + OPC_TIMED_HEADER_LENGTH;
+}
+
+/* Returns 1 if count pixels fit in one message, 0 otherwise. */
+static u8 opc_check_count(u32 count) {
+  if (count > OPC_MAX_PIXELS_PER_FRAME) {
+    fprintf(stderr, "OPC: Maximum pixel count exceeded (%u > %d)\n",
+            count, OPC_MAX_PIXELS_PER_FRAME);
+    return 0;
+  }
+  return 1;
+}
+
+static void opc_put_u32(u8* p, u32 value) {
+  p[0] = value >> 24;
+  p[1] = (value >> 16) & 0xff;
+  p[2] = (value >> 8) & 0xff;
+  p[3] = value & 0xff;
+}
 
-  return opc_send_header(sink, channel, OPC_SET_PIXELS, len) &&
-      opc_send(sink, (u8*) pixels, len, OPC_SEND_TIMEOUT_MS);
+/* Appends one span of pixels to an OPC_SET_PIXEL_SPANS payload at d. */
+/* Returns the new end of the payload. */
+static u8* opc_put_span(u8* d, u32 offset, u32 count, pixel* pixels) {
+  opc_put_u32(d, offset);
+  opc_put_u32(d + 4, count);
+  memcpy(d + OPC_SPAN_HEADER_LENGTH, pixels, count*3);
+  return d + OPC_SPAN_HEADER_LENGTH + count*3;
+}
+
+#define OPC_SAME_PIXEL(p, q) \
+    ((p).r == (q).r && (p).g == (q).g && (p).b == (q).b)
+
+/* Unchanged pixels between two changed ones cost 3 bytes each to resend */
+/* but a new span costs OPC_SPAN_HEADER_LENGTH, so gaps up to this long */
+/* are sent rather than splitting the span. */
+#define OPC_SPAN_MAX_GAP (OPC_SPAN_HEADER_LENGTH/3)
+
+/* Encodes a frame as an OPC_SET_PIXEL_SPANS payload into out, which must */
+/* have room for OPC_SPANS_HEADER_LENGTH + OPC_SPAN_HEADER_LENGTH + */
+/* count*3 bytes.  If previous is NULL, or the spans would take more room */
+/* than that, the whole frame is sent as one span.  Returns the length. */
+static u32 opc_encode_spans(
+    u8* out, pixel* previous, u32 count, pixel* pixels) {
+  u32 full_length = OPC_SPANS_HEADER_LENGTH + OPC_SPAN_HEADER_LENGTH + count*3;
+  u8* d = out + OPC_SPANS_HEADER_LENGTH;
+  u32 start;
+  u32 end;
+  u32 i;
+
+  opc_put_u32(out, count);
+  for (i = 0; previous && i < count; ) {
+    if (OPC_SAME_PIXEL(previous[i], pixels[i])) {
+      i++;
+      continue;
+    }
+    start = i;
+    end = i + 1;
+    for (i = end; i < count && i - end <= OPC_SPAN_MAX_GAP; i++) {
+      if (!OPC_SAME_PIXEL(previous[i], pixels[i])) {
+        end = i + 1;
+      }
+    }
+    if ((d - out) + OPC_SPAN_HEADER_LENGTH + (end - start)*3 > full_length) {
+      previous = NULL;  /* cheaper to send everything */
+      break;
+    }
+    d = opc_put_span(d, start, end - start, pixels + start);
+    i = end;
+  }
+  if (!previous && count > 0) {
+    d = opc_put_span(out + OPC_SPANS_HEADER_LENGTH, 0, count, pixels);
+  }
+  return d - out;
+}
+
+/* Encodes one channel's frame for a delta sink into out (see */
+/* opc_encode_spans) and remembers it as the channel's previous frame. */
+/* Returns the payload length. */
+static u32 opc_encode_delta(
+    opc_sink_info* info, opc_channel_pixels* c, u8* out) {
+  opc_sink_delta* delta = info->delta;
+  pixel* previous = delta->previous[c->channel];
+  u8 known;
+  u32 length;
+
+  /* The server has our previous frame only if it was sent in full on */
+  /* this connection. */
+  known = delta->valid[c->channel] && delta->counts[c->channel] == c->count &&
+      delta->epochs[c->channel] == info->epoch;
+  length = opc_encode_spans(out, known ? previous : NULL, c->count, c->pixels);
+  if (!previous || delta->counts[c->channel] != c->count) {
+    previous = realloc(previous, (c->count ? c->count : 1)*sizeof(pixel));
+    if (!previous) {
+      delta->valid[c->channel] = 0;
+      return length;
+    }
+    delta->previous[c->channel] = previous;
+    delta->counts[c->channel] = c->count;
+  }
+  memcpy(previous, c->pixels, c->count*3);
+  delta->epochs[c->channel] = info->epoch;
+  delta->valid[c->channel] = 1;
+  return length;
+}
+
+/* Makes a delta sink forget the frames it has sent to a channel (or to */
+/* all channels, if channel is -1), so the next frame is sent whole. */
+static void opc_forget_frames(opc_sink sink, int channel) {
+  opc_sink_delta* delta = opc_sinks[sink].delta;
+  int c;
+
+  for (c = 0; delta && c < 256; c++) {
+    if (channel < 0 || channel == c) {
+      delta->valid[c] = 0;
+    }
+  }
+}
+
+u8 opc_set_delta(opc_sink sink, u8 delta) {
+  opc_sink_info* info = &opc_sinks[sink];
+  int c;
+
+  if (sink < 0 || sink >= opc_next_sink) {
+    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+    return 0;
+  }
+  if (!delta) {
+    if (info->delta) {
+      for (c = 0; c < 256; c++) {
+        free(info->delta->previous[c]);
+      }
+      free(info->delta->spans.data);
+      free(info->delta);
+      info->delta = NULL;
+    }
+    return 1;
+  }
+  if (info->type != OPC_SINK_TYPE_SOCKET && info->type != OPC_SINK_TYPE_FILE &&
+      info->type != OPC_SINK_TYPE_RECORDING) {
+    fprintf(stderr, "OPC: Sink %d may lose frames and cannot send deltas\n",
+            sink);
+    return 0;
+  }
+  if (info->queue) {
+    fprintf(stderr, "OPC: Sink %d is asynchronous and cannot send deltas\n",
+            sink);
+    return 0;
+  }
+  if (!info->delta) {
+    info->delta = calloc(1, sizeof(opc_sink_delta));
+    if (!info->delta) {
+      fprintf(stderr, "OPC: Out of memory for delta sink\n");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Makes sure a scratch buffer can hold at least capacity bytes.  Returns */
+/* 1 on success, 0 if out of memory. */
+static u8 opc_reserve(opc_frame* frame, u32 capacity) {
+  u8* data;
+
+  if (frame->capacity < capacity) {
+    data = realloc(frame->data, capacity);
+    if (!data) {
+      fprintf(stderr, "OPC: Out of memory for %u-byte buffer\n", capacity);
+      return 0;
+    }
+    frame->data = data;
+    frame->capacity = capacity;
+  }
+  return 1;
+}
+
+u8 opc_set_compression(opc_sink sink, u8 codec) {
+  if (sink < 0 || sink >= opc_next_sink) {
+    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+    return 0;
+  }
+  if (codec != OPC_CODEC_NONE && codec != OPC_CODEC_RLE &&
+      codec != OPC_CODEC_LZ) {
+    fprintf(stderr, "OPC: Unknown codec %d\n", codec);
+    return 0;
+  }
+  opc_sinks[sink].codec = codec;
+  return 1;
+}
+
+/* Replaces the message described by iov (whose header is header) with */
+/* an OPC_COMPRESSED message wrapping it, if that makes it shorter.  The */
+/* new payload is written at out, which must have room for */
+/* OPC_COMPRESSED_HEADER_LENGTH plus the original payload length. */
+/* Returns the number of bytes used at out (0 if the message is unchanged). */
+static u32 opc_compress_message(
+    u8 codec, struct iovec* iov, u8* header, u8* out) {
+  u32 length = iov[1].iov_len;
+  u32 packed;
+
+  if (length <= OPC_COMPRESSED_HEADER_LENGTH + 1) {
+    return 0;
+  }
+  packed = codec_compress(codec, out + OPC_COMPRESSED_HEADER_LENGTH,
+                          length - OPC_COMPRESSED_HEADER_LENGTH - 1,
+                          iov[1].iov_base, length);
+  if (!packed) {
+    return 0;
+  }
+  out[0] = OPC_COMMAND(header);
+  out[1] = codec;
+  opc_put_u32(out + 2, length);
+  opc_set_message(iov, header, header[0], OPC_COMPRESSED, out,
+                  OPC_COMPRESSED_HEADER_LENGTH + packed);
+  return OPC_COMPRESSED_HEADER_LENGTH + packed;
+}
+
+u8 opc_put_pixels(opc_sink sink, u8 channel, u32 count, pixel* pixels) {
+  opc_channel_pixels c;
+
+  c.channel = channel;
+  c.count = count;
+  c.pixels = pixels;
+  return opc_put_pixels_batch(sink, 1, &c, 0);
+}
+
+u8 opc_put_pixels_at(opc_sink sink, u8 channel, u32 count, pixel* pixels,
+                     u64 time_us) {
+  opc_channel_pixels c;
+
+  c.channel = channel;
+  c.count = count;
+  c.pixels = pixels;
+  return opc_put_pixels_batch_at(sink, 1, &c, 0, time_us);
+}
+
+u8 opc_put_pixels_batch(opc_sink sink, int num_channels,
+                        opc_channel_pixels* channels, u8 sync) {
+  return opc_put_pixels_batch_at(sink, num_channels, channels, sync, 0);
+}
+
+u8 opc_put_pixels_batch_at(opc_sink sink, int num_channels,
+                           opc_channel_pixels* channels, u8 sync,
+                           u64 time_us) {
+  struct iovec iov[2*(OPC_MAX_BATCH + 1)];
+  u8 headers[OPC_MAX_BATCH + 1][OPC_MAX_TIMED_HEADER_LENGTH];
+  opc_sink_info* info = &opc_sinks[sink];
+  opc_sink_delta* delta;
+  u32 needed = 0;
+  u32 length;
+  u8* data;
+  u8 result;
+  int i;
+
+  if (sink < 0 || sink >= opc_next_sink) {
+    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+    return 0;
+  }
+  if (num_channels > OPC_MAX_BATCH) {
+    fprintf(stderr, "OPC: Too many channels in one batch (%d > %d)\n",
+            num_channels, OPC_MAX_BATCH);
+    return 0;
+  }
+  for (i = 0; i < num_channels; i++) {
+    if (!opc_check_count(channels[i].count)) {
+      return 0;
+    }
+    needed += OPC_SPANS_HEADER_LENGTH + OPC_SPAN_HEADER_LENGTH +
+        channels[i].count*3;
+  }
+
+  /* A delta sink encodes every channel's spans into its buffer first. */
+  delta = info->delta;
+  if (delta && !opc_reserve(&delta->spans, needed)) {
+    return 0;
+  }
+  for (i = 0, data = delta ? delta->spans.data : NULL; i < num_channels; i++) {
+    if (delta) {
+      length = opc_encode_delta(info, &channels[i], data);
+      opc_set_message(iov + 2*i, headers[i], channels[i].channel,
+                      OPC_SET_PIXEL_SPANS, data, length);
+      data += length;
+    } else {
+      opc_set_message(iov + 2*i, headers[i], channels[i].channel,
+                      OPC_SET_PIXELS, (u8*) channels[i].pixels,
+                      channels[i].count*3);
+    }
+  }
+
+  /* Then each message is compressed if that makes it shorter. */
+  needed += num_channels*OPC_COMPRESSED_HEADER_LENGTH;
+  if (info->codec != OPC_CODEC_NONE && opc_reserve(&info->packed, needed)) {
+    for (i = 0, data = info->packed.data; i < num_channels; i++) {
+      data += opc_compress_message(info->codec, iov + 2*i, headers[i], data);
+    }
+  }
+
+  /* Then, if a time was given, each message is wrapped with it. */
+  for (i = 0; time_us && i < num_channels; i++) {
+    opc_time_message(iov + 2*i, headers[i], time_us);
+  }
+  i = num_channels;
+  if (sync) {
+    /* A timed sync makes the server show the frame at that time too. */
+    opc_set_message(iov + 2*i, headers[i], 0, OPC_STREAM_SYNC,
+                    OPC_STREAM_SYNC_DATA, OPC_STREAM_SYNC_LENGTH);
+    if (time_us) {
+      opc_time_message(iov + 2*i, headers[i], time_us);
+    }
+    i++;
+  }
+  if (i == 0) {
+    return 1;
+  }
+  result = opc_send_messages(sink, iov, i);
+  if (!result) {
+    /* The server may have missed some of these frames. */
+    for (i = 0; i < num_channels; i++) {
+      opc_forget_frames(sink, channels[i].channel);
+    }
+  }
+  return result;
+}
+
+u8 opc_put_pixels16(opc_sink sink, u8 channel, u32 count, pixel16* pixels,
+                    u8 rgbw) {
+  struct iovec iov[2];
+  u8 header[OPC_MAX_HEADER_LENGTH];
+  opc_sink_info* info = &opc_sinks[sink];
+  u32 size = rgbw ? OPC_PIXEL16_RGBW_LENGTH : OPC_PIXEL16_LENGTH;
+  u32 i;
+  u8* d;
+
+  if (sink < 0 || sink >= opc_next_sink) {
+    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+    return 0;
+  }
+  if (count > OPC_MAX_PAYLOAD_LENGTH/size) {
+    fprintf(stderr, "OPC: Maximum 16-bit pixel count exceeded (%u > %u)\n",
+            count, OPC_MAX_PAYLOAD_LENGTH/size);
+    return 0;
+  }
+  if (!opc_reserve(&info->wide, count*size)) {
+    return 0;
+  }
+  for (i = 0, d = info->wide.data; i < count; i++, d += size) {
+    d[0] = pixels[i].r >> 8;
+    d[1] = pixels[i].r & 0xff;
+    d[2] = pixels[i].g >> 8;
+    d[3] = pixels[i].g & 0xff;
+    d[4] = pixels[i].b >> 8;
+    d[5] = pixels[i].b & 0xff;
+    if (rgbw) {
+      d[6] = pixels[i].w >> 8;
+      d[7] = pixels[i].w & 0xff;
+    }
+  }
+  opc_set_message(iov, header, channel,
+                  rgbw ? OPC_SET_PIXELS_16_RGBW : OPC_SET_PIXELS_16,
+                  info->wide.data, count*size);
+  if (info->codec != OPC_CODEC_NONE &&
+      opc_reserve(&info->packed, count*size + OPC_COMPRESSED_HEADER_LENGTH)) {
+    opc_compress_message(info->codec, iov, header, info->packed.data);
+  }
+  opc_forget_frames(sink, channel);  /* spans are only sent as 8-bit data */
+  return opc_send_messages(sink, iov, 1);
+}
+
+u8 opc_put_messages(opc_sink sink, u8* data, u32 length) {
+  struct iovec iov[2*(OPC_MAX_BATCH + 1)];
+  int count;
+
+  count = opc_split_messages(data, length, iov, OPC_MAX_BATCH + 1);
+  if (count < 0) {
+    fprintf(stderr, "OPC: Malformed or oversized block of messages\n");
+    return 0;
+  }
+  if (sink >= 0 && sink < opc_next_sink) {
+    opc_forget_frames(sink, -1);  /* these messages may change any frame */
+  }
+  return count > 0 ? opc_send_messages(sink, iov, count) : 1;
+}
+
+u64 opc_now_us() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (u64) now.tv_sec*1000000 + now.tv_nsec/1000;
 }
 
 u8 opc_stream_sync(opc_sink sink) {
-  ssize_t len = OPC_STREAM_SYNC_LENGTH;
-  u8* data = OPC_STREAM_SYNC_DATA;
+  struct iovec iov[2];
+  u8 header[OPC_MAX_HEADER_LENGTH];
+
+  opc_set_message(iov, header, 0, OPC_STREAM_SYNC,
+                  OPC_STREAM_SYNC_DATA, OPC_STREAM_SYNC_LENGTH);
+  return opc_send_messages(sink, iov, 1);
+}
+
+opc_group opc_new_group() {
+  /* Allocate an opc_group_info entry. */
+  if (opc_next_group >= OPC_MAX_GROUPS) {
+    fprintf(stderr, "OPC: No more groups available\n");
+    return -1;
+  }
+  opc_groups[opc_next_group].num_sinks = 0;
+  return opc_next_group++;
+}
+
+u8 opc_group_add(opc_group group, opc_sink sink) {
+  opc_group_info* g = &opc_groups[group];
+
+  if (group < 0 || group >= opc_next_group) {
+    fprintf(stderr, "OPC: Group %d does not exist\n", group);
+    return 0;
+  }
+  if (sink < 0 || sink >= opc_next_sink) {
+    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+    return 0;
+  }
+  if (g->num_sinks >= OPC_MAX_SINKS) {
+    fprintf(stderr, "OPC: Group %d is full\n", group);
+    return 0;
+  }
+  g->sinks[g->num_sinks++] = sink;
+  return 1;
+}
+
+/* Returns the number of microseconds elapsed since start. */
+static u32 opc_elapsed_us(struct timespec* start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec)*1000000 +
+      (now.tv_nsec - start->tv_nsec)/1000;
+}
+
+/* Makes one non-blocking attempt to send the rest of a message (given */
+/* as a header and payload iovec pair) to a connected socket sink, given */
+/* that sent bytes have already gone out.  Returns the number of bytes */
+/* sent, 0 if the socket is full, or -1 on error. */
+static ssize_t opc_send_socket_partial(
+    opc_sink_socket* ss, struct iovec* message, size_t sent) {
+  struct iovec iov[2];
+  struct iovec* p = iov;
+  struct msghdr msg;
+  ssize_t result;
+
+  iov[0] = message[0];
+  iov[1] = message[1];
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iovlen = opc_skip_iov(&p, 2, sent);
+  msg.msg_iov = p;
+  result = sendmsg(ss->sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  return result;
+}
+
+int opc_group_put_pixels(opc_group group, u8 channel, u32 count,
+                         pixel* pixels, opc_delivery* results) {
+  opc_group_info* g = &opc_groups[group];
+  opc_sink_socket* ss;
+  struct pollfd fds[OPC_MAX_SINKS];
+  int members[OPC_MAX_SINKS];
+  int socks[OPC_MAX_SINKS];
+  size_t sent[OPC_MAX_SINKS];
+  u8 state[OPC_MAX_SINKS];
+  struct iovec message[2];
+  struct iovec iov[2];
+  u8 header[OPC_MAX_HEADER_LENGTH];
+  struct timespec start;
+  u32 elapsed_ms;
+  ssize_t n;
+  int nfds;
+  int delivered = 0;
+  int i;
+  int f;
+
+  if (group < 0 || group >= opc_next_group) {
+    fprintf(stderr, "OPC: Group %d does not exist\n", group);
+    return 0;
+  }
+  if (!opc_check_count(count)) {
+    return 0;
+  }
+  opc_set_message(
+      message, header, channel, OPC_SET_PIXELS, (u8*) pixels, count*3);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  /* Deliver right away to sinks that cannot block for long, and start */
+  /* connecting or sending on all the TCP sinks. */
+  for (i = 0; i < g->num_sinks; i++) {
+    results[i].sink = g->sinks[i];
+    results[i].sent = 0;
+    results[i].latency_us = 0;
+    state[i] = OPC_DELIVERY_DONE;
+    opc_forget_frames(g->sinks[i], channel);  /* a full frame goes out */
+    ss = &(opc_sinks[g->sinks[i]].u.socket);
+    if (opc_sinks[g->sinks[i]].queue ||
+        opc_sinks[g->sinks[i]].type != OPC_SINK_TYPE_SOCKET) {
+      iov[0] = message[0];  /* opc_send_messages modifies its iovecs */
+      iov[1] = message[1];
+      results[i].sent = opc_send_messages(g->sinks[i], iov, 1);
+      results[i].latency_us = opc_elapsed_us(&start);
+    } else if (ss->sock >= 0) {
+      state[i] = OPC_DELIVERY_SENDING;
+      sent[i] = 0;
+    } else {
+      socks[i] = opc_start_connect(ss);
+      if (socks[i] >= 0) {
+        state[i] = OPC_DELIVERY_CONNECTING;
+      }
+    }
+  }
+
+  /* Wait on all the unfinished TCP sinks together. */
+  while ((elapsed_ms = opc_elapsed_us(&start)/1000) < OPC_SEND_TIMEOUT_MS) {
+    for (i = 0, nfds = 0; i < g->num_sinks; i++) {
+      if (state[i] != OPC_DELIVERY_DONE) {
+        ss = &(opc_sinks[g->sinks[i]].u.socket);
+        fds[nfds].fd = state[i] == OPC_DELIVERY_CONNECTING ? socks[i] : ss->sock;
+        fds[nfds].events = POLLOUT;
+        fds[nfds].revents = 0;
+        members[nfds++] = i;
+      }
+    }
+    if (nfds == 0 || poll(fds, nfds, OPC_SEND_TIMEOUT_MS - elapsed_ms) <= 0) {
+      break;
+    }
+    for (f = 0; f < nfds; f++) {
+      if (!fds[f].revents) {
+        continue;
+      }
+      i = members[f];
+      ss = &(opc_sinks[g->sinks[i]].u.socket);
+      if (state[i] == OPC_DELIVERY_CONNECTING) {
+        state[i] = OPC_DELIVERY_DONE;
+        if (opc_finish_connect(ss, socks[i], OPC_SEND_TIMEOUT_MS) == 0) {
+          state[i] = OPC_DELIVERY_SENDING;
+          sent[i] = 0;
+        }
+        continue;
+      }
+      n = opc_send_socket_partial(ss, message, sent[i]);
+      if (n < 0) {
+        fprintf(stderr, "OPC: Error sending data to %s: %s\n",
+                ss->address_string, strerror(errno));
+        opc_close(g->sinks[i]);
+        state[i] = OPC_DELIVERY_DONE;
+      } else if ((sent[i] += n) == message[0].iov_len + message[1].iov_len) {
+        results[i].sent = 1;
+        results[i].latency_us = opc_elapsed_us(&start);
+        state[i] = OPC_DELIVERY_DONE;
+      }
+    }
+  }
 
-  return opc_send_header(sink, 0, OPC_STREAM_SYNC, len) &&
-      opc_send(sink, data, len, OPC_SEND_TIMEOUT_MS);
+  /* Give up on whatever has not finished; a connection that carries a */
+  /* partial message can no longer be used. */
+  for (i = 0; i < g->num_sinks; i++) {
+    ss = &(opc_sinks[g->sinks[i]].u.socket);
+    if (state[i] == OPC_DELIVERY_CONNECTING) {
+      fprintf(stderr, "OPC: No connection to %s after %d ms\n",
+              ss->address_string, OPC_SEND_TIMEOUT_MS);
+      close(socks[i]);
+    } else if (state[i] == OPC_DELIVERY_SENDING) {
+      fprintf(stderr, "OPC: Timed out sending to %s\n", ss->address_string);
+      if (sent[i] > 0) {
+        opc_close(g->sinks[i]);
+      }
+    }
+    delivered += results[i].sent;
+  }
+  return delivered;
 }
@@ -0,0 +1,58 @@
+/* Copyright 2016 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// Drives LED strips on several outputs, each with its own driver (so one
+// process can run APA102 and WS2801 strips side by side), from one OPC
+// server and color stage, sending each channel where a routing table says.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cli.h"
+#include "opc.h"
+#include "route.h"
+
+static route_table* table;
+
+void led_put_channel(u8 channel, u32 count, pixel* pixels) {
+  route_put_pixels(table, channel, count, pixels);
+}
+
+void led_flush() {
+  route_flush(table);
+}
+
+// Used for the diagnostic pixels, which go to every route (as channel 0).
+void led_put_pixels(u8* buffer, u32 count, pixel* pixels) {
+  (void) buffer;
+  route_put_pixels(table, 0, count, pixels);
+  route_flush(table);
+}
+
+int main(int argc, char** argv) {
+  u16 port = OPC_DEFAULT_PORT;
+
+  get_server_options(&argc, &argv);
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [<options>] <routes.json> [<port>]\n",
+            argv[0]);
+    return 1;
+  }
+  if (argc > 2) {
+    port = atoi(argv[2]);
+  }
+  table = route_load(argv[1]);
+  if (!table) {
+    return 1;
+  }
+  opc_serve_channels(led_put_channel, led_flush);
+  return opc_serve_main(port, led_put_pixels, NULL);
+}
@@ -0,0 +1,177 @@
+/* Copyright 2013 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// Plays back a recording made by opc_new_sink_recording at its original pace.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "opc.h"
+
+// One entry per record, built by scanning the record headers once.
+typedef struct {
+  u64 time_us;
+  u8* data;
+  u32 length;
+} record;
+
+record* records;
+int num_records = 0;
+
+u64 get_u64(u8* p) {
+  u64 value = 0;
+  int i;
+  for (i = 0; i < 8; i++) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+u32 get_u32(u8* p) {
+  return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+void load_recording(char* filename) {
+  struct stat st;
+  u8* data;
+  u8* p;
+  u8* end;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Unable to open '%s'\n", filename);
+    exit(1);
+  }
+  if (st.st_size < OPC_RECORDING_MAGIC_LENGTH) {
+    fprintf(stderr, "'%s' is not an OPC recording\n", filename);
+    exit(1);
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED ||
+      memcmp(data, OPC_RECORDING_MAGIC, OPC_RECORDING_MAGIC_LENGTH)) {
+    fprintf(stderr, "'%s' is not an OPC recording\n", filename);
+    exit(1);
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  // Index the records; a truncated final record is ignored.
+  end = data + st.st_size;
+  records = malloc(sizeof(record) * (st.st_size / OPC_RECORD_HEADER_LENGTH));
+  for (p = data + OPC_RECORDING_MAGIC_LENGTH;
+       end - p >= OPC_RECORD_HEADER_LENGTH; ) {
+    records[num_records].time_us = get_u64(p);
+    records[num_records].length = get_u32(p + 8);
+    records[num_records].data = p + OPC_RECORD_HEADER_LENGTH;
+    p += OPC_RECORD_HEADER_LENGTH;
+    if (end - p < records[num_records].length) {
+      break;
+    }
+    p += records[num_records++].length;
+  }
+  fprintf(stderr, "Loaded %d records (%.3f s) from '%s'\n", num_records,
+          num_records ? records[num_records - 1].time_us*1e-6 : 0, filename);
+}
+
+// Returns the index of the first record at or after time_us.
+int find_record(u64 time_us) {
+  int low = 0, high = num_records;
+  while (low < high) {
+    int mid = (low + high)/2;
+    if (records[mid].time_us < time_us) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+void add_us(struct timespec* t, u64 us) {
+  t->tv_sec += us / 1000000;
+  t->tv_nsec += (us % 1000000) * 1000;
+  if (t->tv_nsec >= 1000000000) {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000;
+  }
+}
+
+void usage(char* prog_name) {
+  fprintf(stderr, "Usage: %s [-l] [-s <speed>] [-t <seconds>] "
+          "<filename> <server>[:<port>]\n", prog_name);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  int loop = 0;
+  double speed = 1.0;
+  double start_s = 0;
+  int opt;
+  int first, i;
+  u64 offset_us;
+  struct timespec base, target;
+  opc_sink s;
+
+  while ((opt = getopt(argc, argv, ":hls:t:")) != -1)
+  {
+      switch (opt)
+      {
+      case 'l':
+          loop = 1;
+          break;
+      case 's':
+          speed = strtod(optarg, NULL);
+          break;
+      case 't':
+          start_s = strtod(optarg, NULL);
+          break;
+      case ':':
+          fprintf(stderr, "Missing argument to option: '%c'\n", optopt);
+          usage(argv[0]);
+      case '?':
+          fprintf(stderr, "Option not recognized: '%c'\n", optopt);
+          usage(argv[0]);
+      case 'h':
+      default:
+          usage(argv[0]);
+      }
+  }
+  if (argc - optind != 2 || speed <= 0 || start_s < 0) {
+      usage(argv[0]);
+  }
+  load_recording(argv[optind]);
+  s = opc_new_sink(argv[optind + 1]);
+  if (s < 0 || num_records == 0) {
+    return 1;
+  }
+
+  // Frame i is due at base + (time_i - time_first)/speed.
+  first = find_record((u64) (start_s*1e6));
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &base);
+    for (i = first; i < num_records; i++) {
+      offset_us = (records[i].time_us - records[first].time_us) / speed;
+      target = base;
+      add_us(&target, offset_us);
+      while (clock_nanosleep(
+          CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR);
+      opc_put_messages(s, records[i].data, records[i].length);
+    }
+  } while (loop && first < num_records);
+  return 0;
+}
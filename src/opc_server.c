@@ -9,26 +9,140 @@ under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
 CONDITIONS OF ANY KIND, either express or implied.  See the License for the
 specific language governing permissions and limitations under the License. */
 
+#define _GNU_SOURCE  /* for recvmmsg */
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include "codec.h"
 #include "opc.h"
+#include "shm.h"
 
-/* Internal structure for a source.  sock >= 0 iff the connection is open. */
+#define OPC_SOURCE_TYPE_SINGLE 0
+#define OPC_SOURCE_TYPE_MULTI 1
+#define OPC_SOURCE_TYPE_UDP 2
+#define OPC_SOURCE_TYPE_SHM 3
+
+/* Maximum number of datagrams fetched by one call to opc_receive. */
+#define OPC_MAX_DATAGRAMS 16
+
+/* Maximum number of epoll events handled by one call to opc_receive. */
+#define OPC_MAX_EVENTS 16
+
+/* epoll tag for the listening socket (connections are tagged by slot). */
+#define OPC_LISTEN_TAG OPC_MAX_CONNECTIONS
+
+/* Size of each connection's receive buffer; must exceed the largest */
+/* acceptable message (an 8-byte header plus OPC_MAX_PAYLOAD_LENGTH). */
+#define OPC_RECV_BUFFER_SIZE (1 << 20)
+
+/* True for the commands carrying pixel data, which coalescing may skip */
+/* (a compressed message is taken to be pixel data). */
+#define OPC_IS_PIXELS(command) \
+    ((command) == OPC_SET_PIXELS || \
+     (command) == OPC_SET_PIXEL_SPANS || \
+     (command) == OPC_SET_PIXELS_16 || \
+     (command) == OPC_SET_PIXELS_16_RGBW || \
+     (command) == OPC_COMPRESSED)
+
+/* Whether a command wraps or acts on other messages; none of these may */
+/* appear inside an OPC_COMPRESSED message. */
+#define OPC_IS_WRAPPER(command) \
+    ((command) == OPC_TIMED || \
+     (command) == OPC_COMPRESSED || \
+     (command) == OPC_STREAM_SYNC)
+
+/* Pixel data held back until the next OPC_STREAM_SYNC: count pixels (or */
+/* pixel16s, if wide is set) in data, which has room for capacity bytes. */
+typedef struct {
+  u8 dirty;
+  u8 wide;
+  u32 count;
+  u32 capacity;
+  u8* data;
+} opc_staged;
+
+/* Parse state for one client connection.  sock >= 0 iff it is open. */
+/* Bytes in buffer[start..end) have been received but not yet dispatched; */
+/* a partial message is moved back to the front of the buffer when there */
+/* is no room left after it, so every payload is contiguous in memory. */
+/* synced is set once the connection has sent an OPC_STREAM_SYNC; from */
+/* then on its pixel data is held in staged[] (allocated on first use) */
+/* until its next sync, so each client's frames are committed only by */
+/* that client's syncs. */
+typedef struct {
+  int sock;
+  u32 start;
+  u32 end;
+  u8* buffer;
+  u8 synced;
+  opc_staged* staged;
+} opc_connection;
+
+/* A timed message waiting for its presentation time.  data has room for */
+/* capacity bytes, of which the first length are the wrapped payload. */
+/* staging is the source's staging connection when the message arrived. */
 typedef struct {
+  u64 time_us;
+  u8 channel;
+  u8 command;
+  opc_connection* staging;
+  u32 length;
+  u32 capacity;
+  u8* data;
+} opc_pending;
+
+/* Internal structure for a source.  A single-connection source stops */
+/* listening while its one connection is open; a multi-connection source */
+/* keeps listening and tracks each open connection in conns[].  frames[c] */
+/* is the retained frame of frame_counts[c] pixels for channel c, or NULL */
+/* until channel c first receives an OPC_SET_PIXEL_SPANS message. */
+/* decoded holds the payload of the last OPC_COMPRESSED message; wide and */
+/* narrow hold the last 16-bit frame unpacked and reduced to 8 bits. */
+/* pending[0..num_pending) are timed messages in order of time; the */
+/* entries after them keep their buffers for reuse.  staging is the */
+/* connection whose message is being handled, if that connection stages */
+/* its pixel data, or else NULL; committing is set while a staged frame */
+/* is being delivered. */
+/* releasing is set while pending timed messages are being acted on. */
+typedef struct {
+  u8 type;
+  u8 coalesce;
   u16 port;
   int listen_sock;
-  int sock;
-  u16 header_length;
-  u8 header[4];
-  u16 payload_length;
-  u8 payload[1 << 16];
+  opc_connection conn;
+  int epoll_fd;
+  opc_connection* conns[OPC_MAX_CONNECTIONS];
+  u8* datagrams;  /* OPC_MAX_DATAGRAMS buffers for a UDP source */
+  shm_ring* ring;  /* shared-memory ring for a shared-memory source */
+  pixel* frames[256];
+  u32 frame_counts[256];
+  u8* decoded;
+  opc_handler16* handler16;
+  pixel16* wide;
+  pixel* narrow;
+  opc_pending pending[OPC_MAX_PENDING];
+  int num_pending;
+  u8 releasing;
+  opc_connection* staging;
+  u8 committing;
+  opc_sync_handler* sync_handler;
+  opc_stats stats;
+  u8 timing;
+  opc_times times;
 } opc_source_info;
 
 static opc_source_info opc_sources[OPC_MAX_SOURCES];
@@ -67,11 +181,23 @@ opc_source opc_new_source(u16 port) {
     return -1;
   }
   info = &opc_sources[opc_next_source];
+  info->type = OPC_SOURCE_TYPE_SINGLE;
+  info->coalesce = 0;
+  info->datagrams = NULL;
+  info->conn.sock = -1;
+  info->conn.buffer = malloc(OPC_RECV_BUFFER_SIZE);
+  info->epoll_fd = -1;
+  if (!info->conn.buffer) {
+    fprintf(stderr, "OPC: Out of memory for source on port %d\n", port);
+    return -1;
+  }
 
   /* Listen on the specified port. */
   info->port = port;
   info->listen_sock = opc_listen(port);
   if (info->listen_sock < 0) {
+    free(info->conn.buffer);
+    info->conn.buffer = NULL;
     return -1;
   }
 
@@ -80,81 +206,720 @@ opc_source opc_new_source(u16 port) {
   return opc_next_source++;
 }
 
-u8 opc_receive(opc_source source, opc_handler* handler, u32 timeout_ms) {
+#ifdef __linux__
+opc_source opc_new_source_multi(u16 port) {
+  opc_source_info* info;
+  struct epoll_event event;
+  int c;
+
+  /* Allocate an opc_source_info entry. */
+  if (opc_next_source >= OPC_MAX_SOURCES) {
+    fprintf(stderr, "OPC: No more sources available\n");
+    return -1;
+  }
+  info = &opc_sources[opc_next_source];
+  info->type = OPC_SOURCE_TYPE_MULTI;
+  info->coalesce = 0;
+  info->datagrams = NULL;
+  info->conn.sock = -1;
+  for (c = 0; c < OPC_MAX_CONNECTIONS; c++) {
+    info->conns[c] = NULL;
+  }
+
+  /* Listen on the specified port and watch the socket with epoll. */
+  info->port = port;
+  info->listen_sock = opc_listen(port);
+  if (info->listen_sock < 0) {
+    return -1;
+  }
+  fcntl(info->listen_sock, F_SETFL, O_NONBLOCK);
+  info->epoll_fd = epoll_create1(0);
+  if (info->epoll_fd < 0) {
+    perror("OPC: Could not create epoll instance");
+    close(info->listen_sock);
+    return -1;
+  }
+  event.events = EPOLLIN;
+  event.data.u32 = OPC_LISTEN_TAG;
+  epoll_ctl(info->epoll_fd, EPOLL_CTL_ADD, info->listen_sock, &event);
+
+  /* Increment opc_next_source only if we were successful. */
+  fprintf(stderr, "OPC: Listening on port %d (up to %d clients)\n",
+          port, OPC_MAX_CONNECTIONS);
+  return opc_next_source++;
+}
+#else
+/* Without epoll, fall back to accepting one connection at a time. */
+opc_source opc_new_source_multi(u16 port) {
+  return opc_new_source(port);
+}
+#endif
+
+opc_source opc_new_source_udp(u16 port) {
+  opc_source_info* info;
+  struct sockaddr_in address;
+  int sock;
+  int rcvbuf = OPC_MAX_DATAGRAMS * OPC_MAX_DATAGRAM_SIZE;
+
+  /* Allocate an opc_source_info entry. */
+  if (opc_next_source >= OPC_MAX_SOURCES) {
+    fprintf(stderr, "OPC: No more sources available\n");
+    return -1;
+  }
+  info = &opc_sources[opc_next_source];
+  info->type = OPC_SOURCE_TYPE_UDP;
+  info->coalesce = 0;
+  info->port = port;
+  info->listen_sock = -1;
+  info->epoll_fd = -1;
+  info->datagrams = malloc(OPC_MAX_DATAGRAMS * OPC_MAX_DATAGRAM_SIZE);
+  if (!info->datagrams) {
+    fprintf(stderr, "OPC: Out of memory for source on port %d\n", port);
+    return -1;
+  }
+
+  /* Bind a datagram socket to the specified port, asking for enough */
+  /* kernel buffering to hold a full batch of maximum-size datagrams. */
+  sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  bzero(&address.sin_addr, sizeof(address.sin_addr));
+  if (bind(sock, (struct sockaddr*) &address, sizeof(address)) != 0) {
+    fprintf(stderr, "OPC: Could not bind to UDP port %d: ", port);
+    perror(NULL);
+    close(sock);
+    free(info->datagrams);
+    return -1;
+  }
+  info->conn.sock = sock;
+
+  /* Increment opc_next_source only if we were successful. */
+  fprintf(stderr, "OPC: Listening on UDP port %d\n", port);
+  return opc_next_source++;
+}
+
+opc_source opc_new_source_shm(char* name) {
+  opc_source_info* info;
+
+  /* Allocate an opc_source_info entry. */
+  if (opc_next_source >= OPC_MAX_SOURCES) {
+    fprintf(stderr, "OPC: No more sources available\n");
+    return -1;
+  }
+  info = &opc_sources[opc_next_source];
+  info->type = OPC_SOURCE_TYPE_SHM;
+  info->coalesce = 0;
+  info->listen_sock = -1;
+  info->epoll_fd = -1;
+  info->conn.sock = -1;
+  info->ring = shm_map(name, 1);
+  if (!info->ring) {
+    return -1;
+  }
+
+  /* Increment opc_next_source only if we were successful. */
+  fprintf(stderr, "OPC: Reading shared memory %s\n", name);
+  return opc_next_source++;
+}
+
+static u32 opc_get_u32(u8* p) {
+  return ((u32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Resizes the retained frame for a channel, zero-filling any new pixels. */
+/* Returns 1 on success, 0 if out of memory. */
+static u8 opc_resize_frame(opc_source_info* info, u8 channel, u32 count) {
+  u32 old_count = info->frames[channel] ? info->frame_counts[channel] : 0;
+  pixel* pixels;
+
+  if (info->frames[channel] && old_count == count) {
+    return 1;
+  }
+  pixels = realloc(info->frames[channel], (count ? count : 1)*sizeof(pixel));
+  if (!pixels) {
+    fprintf(stderr, "OPC: Out of memory for channel %d\n", channel);
+    return 0;
+  }
+  if (count > old_count) {
+    memset(pixels + old_count, 0, (count - old_count)*sizeof(pixel));
+  }
+  info->frames[channel] = pixels;
+  info->frame_counts[channel] = count;
+  return 1;
+}
+
+/* Applies the spans in an OPC_SET_PIXEL_SPANS payload to the retained */
+/* frame for a channel.  Returns 0, leaving the frame untouched, if the */
+/* payload is malformed. */
+static u8 opc_apply_spans(
+    opc_source_info* info, u8 channel, u8* payload, u32 length) {
+  u32 count;
+  u32 offset;
+  u32 n;
+  u32 pos;
+
+  if (length < OPC_SPANS_HEADER_LENGTH) {
+    return 0;
+  }
+  count = opc_get_u32(payload);
+  if (count > OPC_MAX_PIXELS_PER_FRAME) {
+    return 0;
+  }
+  for (pos = OPC_SPANS_HEADER_LENGTH; pos < length;
+       pos += OPC_SPAN_HEADER_LENGTH + n*3) {
+    if (length - pos < OPC_SPAN_HEADER_LENGTH) {
+      return 0;
+    }
+    offset = opc_get_u32(payload + pos);
+    n = opc_get_u32(payload + pos + 4);
+    if (offset > count || n > count - offset ||
+        (length - pos - OPC_SPAN_HEADER_LENGTH)/3 < n) {
+      return 0;
+    }
+  }
+  if (!opc_resize_frame(info, channel, count)) {
+    return 0;
+  }
+  for (pos = OPC_SPANS_HEADER_LENGTH; pos < length;
+       pos += OPC_SPAN_HEADER_LENGTH + n*3) {
+    offset = opc_get_u32(payload + pos);
+    n = opc_get_u32(payload + pos + 4);
+    memcpy(info->frames[channel] + offset,
+           payload + pos + OPC_SPAN_HEADER_LENGTH, n*3);
+  }
+  return 1;
+}
+
+/* Decompresses an OPC_COMPRESSED payload into the source's decode */
+/* buffer, storing the length of the wrapped payload in *decoded_length. */
+/* Returns 0 if the payload is malformed, which includes wrapping another */
+/* wrapper: that could lead back here to decode the buffer into itself. */
+static u8 opc_decompress(opc_source_info* info, u8* payload, u32 length,
+                         u32* decoded_length) {
+  u32 n;
+
+  if (length < OPC_COMPRESSED_HEADER_LENGTH || OPC_IS_WRAPPER(payload[0])) {
+    return 0;
+  }
+  n = opc_get_u32(payload + 2);
+  if (n > OPC_MAX_PAYLOAD_LENGTH ||
+      (payload[0] == OPC_SET_PIXELS && n > OPC_MAX_PIXELS_PER_FRAME*3)) {
+    return 0;
+  }
+  if (!info->decoded && !(info->decoded = malloc(OPC_MAX_PAYLOAD_LENGTH))) {
+    fprintf(stderr, "OPC: Out of memory for decompression\n");
+    return 0;
+  }
+  if (!codec_decompress(payload[1], info->decoded, n,
+                        payload + OPC_COMPRESSED_HEADER_LENGTH,
+                        length - OPC_COMPRESSED_HEADER_LENGTH)) {
+    return 0;
+  }
+  *decoded_length = n;
+  return 1;
+}
+
+/* Keeps a copy of count pixels (pixel16s if wide is set) for a channel */
+/* until the staging connection's next OPC_STREAM_SYNC, replacing any copy */
+/* already held. */
+static void opc_stage(opc_source_info* info, u8 channel, u8 wide,
+                      u32 count, void* pixels) {
+  u32 size = count*(wide ? sizeof(pixel16) : sizeof(pixel));
+  opc_connection* conn = info->staging;
+  opc_staged* st;
+  u8* data;
+
+  if (!conn->staged && !(conn->staged = calloc(256, sizeof(opc_staged)))) {
+    fprintf(stderr, "OPC: Out of memory for staged frames\n");
+    return;
+  }
+  st = &conn->staged[channel];
+  if (st->capacity < size) {
+    data = realloc(st->data, size);
+    if (!data) {
+      fprintf(stderr, "OPC: Out of memory for channel %d\n", channel);
+      return;
+    }
+    st->data = data;
+    st->capacity = size;
+  }
+  memcpy(st->data, pixels, size);
+  st->dirty = 1;
+  st->wide = wide;
+  st->count = count;
+}
+
+/* Passes pixel data to the handler, or stages it if the source is staging. */
+static void opc_deliver(opc_source_info* info, opc_handler* handler,
+                        u8 channel, u32 count, pixel* pixels) {
+  if (info->staging) {
+    opc_stage(info, channel, 0, count, pixels);
+  } else {
+    handler(channel, count, pixels);
+  }
+}
+
+/* Delivers every channel staged by the staging connection in channel */
+/* order, then ends the frame. */
+static void opc_commit(opc_source_info* info, opc_handler* handler) {
+  opc_connection* conn = info->staging;
+  opc_staged* st;
+  int c;
+
+  info->committing = 1;
+  for (c = 0; conn && conn->staged && c < 256; c++) {
+    st = &conn->staged[c];
+    if (st->dirty) {
+      st->dirty = 0;
+      if (!st->wide) {
+        handler(c, st->count, (pixel*) st->data);
+      } else if (info->handler16) {
+        info->handler16(c, st->count, (pixel16*) st->data);
+      }
+    }
+  }
+  info->committing = 0;
+  if (info->sync_handler) {
+    info->sync_handler();
+  }
+}
+
+/* Returns 1 if a message is a well-formed OPC_STREAM_SYNC. */
+static u8 opc_is_sync(u8 command, u8* payload, u32 length) {
+  return command == OPC_STREAM_SYNC && length == OPC_STREAM_SYNC_LENGTH &&
+      memcmp(payload, OPC_STREAM_SYNC_DATA, OPC_STREAM_SYNC_LENGTH) == 0;
+}
+
+/* Notes whether a message from a connection is to be staged: pixel data */
+/* is staged from the first OPC_STREAM_SYNC (timed or not) the connection */
+/* sends onward. */
+static void opc_set_staging(opc_source_info* info, opc_connection* conn,
+                            u8* header, u32 header_length, u32 length) {
+  u8* payload = header + header_length;
+
+  if (opc_is_sync(header[1], payload, length) ||
+      (OPC_COMMAND(header) == OPC_TIMED && length > OPC_TIMED_HEADER_LENGTH &&
+       opc_is_sync(payload[0], payload + OPC_TIMED_HEADER_LENGTH,
+                   length - OPC_TIMED_HEADER_LENGTH))) {
+    conn->synced = 1;
+  }
+  info->staging = conn->synced ? conn : NULL;
+}
+
+/* Discards the staged frame of a connection that is closing.  Any of its */
+/* timed messages still pending take effect unstaged when they fall due. */
+static void opc_unstage(opc_source_info* info, opc_connection* conn) {
+  int i;
+  int c;
+
+  for (i = 0; i < info->num_pending; i++) {
+    if (info->pending[i].staging == conn) {
+      info->pending[i].staging = NULL;
+    }
+  }
+  for (c = 0; conn->staged && c < 256; c++) {
+    free(conn->staged[c].data);
+  }
+  free(conn->staged);
+  conn->staged = NULL;
+  conn->synced = 0;
+}
+
+/* Reduces a 16-bit value to 8 bits, rounding to nearest. */
+#define OPC_REDUCE16(v) (((v) + 128 - ((v) >> 8)) >> 8)
+
+/* Acts on a 16-bit pixel data message: unpacks it for the 16-bit handler */
+/* if the source has one, and otherwise (or if the channel has a retained */
+/* frame to update) reduces it to 8-bit pixels. */
+static void opc_dispatch16(opc_source_info* info, u8 channel, u8 rgbw,
+                           u8* payload, u32 length, opc_handler* handler,
+                           u8 deliver) {
+  u32 size = rgbw ? OPC_PIXEL16_RGBW_LENGTH : OPC_PIXEL16_LENGTH;
+  u32 count = length/size;
+  u32 value;
+  u32 i;
+  u8* p;
+
+  if (!info->wide) {
+    info->wide = malloc(OPC_MAX_PAYLOAD_LENGTH/OPC_PIXEL16_LENGTH*
+                        sizeof(pixel16));
+    info->narrow = malloc(OPC_MAX_PAYLOAD_LENGTH/OPC_PIXEL16_LENGTH*
+                          sizeof(pixel));
+    if (!info->wide || !info->narrow) {
+      fprintf(stderr, "OPC: Out of memory for 16-bit pixels\n");
+      free(info->wide);
+      free(info->narrow);
+      info->wide = NULL;
+      info->narrow = NULL;
+      return;
+    }
+  }
+  for (i = 0, p = payload; i < count; i++, p += size) {
+    info->wide[i].r = (p[0] << 8) | p[1];
+    info->wide[i].g = (p[2] << 8) | p[3];
+    info->wide[i].b = (p[4] << 8) | p[5];
+    info->wide[i].w = rgbw ? (p[6] << 8) | p[7] : 0;
+  }
+  if (deliver && info->handler16) {
+    if (info->staging) {
+      opc_stage(info, channel, 1, count, info->wide);
+    } else {
+      info->handler16(channel, count, info->wide);
+    }
+    if (!info->frames[channel]) {
+      return;
+    }
+  }
+
+  /* White is added into each of R, G and B for 8-bit handlers. */
+  for (i = 0; i < count; i++) {
+    value = info->wide[i].r + info->wide[i].w;
+    info->narrow[i].r = OPC_REDUCE16(value > 0xffff ? 0xffff : value);
+    value = info->wide[i].g + info->wide[i].w;
+    info->narrow[i].g = OPC_REDUCE16(value > 0xffff ? 0xffff : value);
+    value = info->wide[i].b + info->wide[i].w;
+    info->narrow[i].b = OPC_REDUCE16(value > 0xffff ? 0xffff : value);
+  }
+  if (info->frames[channel] && opc_resize_frame(info, channel, count)) {
+    memcpy(info->frames[channel], info->narrow, count*3);
+  }
+  if (deliver && !info->handler16) {
+    opc_deliver(info, handler, channel, count, info->narrow);
+  }
+}
+
+/* Records the monotonic time in one of a source's times, if timing is on. */
+#define OPC_MARK(info, field) \
+    do { if ((info)->timing) (info)->times.field = opc_clock_ns(); } while (0)
+
+static u64 opc_clock_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (u64) now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+/* Returns the current time on the shared presentation clock. */
+static u64 opc_clock_us() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (u64) now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+static void opc_dispatch(opc_source_info* info, u8 channel, u8 command,
+                         u8* payload, u32 length, opc_handler* handler,
+                         u8 deliver);
+
+/* Acts on the first count pending timed messages and removes them from */
+/* the queue.  With coalescing, only the newest pixel data message for each */
+/* channel among them reaches the handler.  Each is staged for the */
+/* connection that sent it; the source's own staging is left as it was. */
+static void opc_release_pending(
+    opc_source_info* info, int count, opc_handler* handler) {
+  opc_pending released[OPC_MAX_PENDING];
+  opc_connection* staging = info->staging;
+  int latest[256];
+  opc_pending* p;
+  u8 deliver;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    p = &info->pending[i];
+    if (info->coalesce && OPC_IS_PIXELS(p->command)) {
+      latest[p->channel] = i;
+    }
+  }
+  info->times.readable_ns = info->times.complete_ns = 0;
+  info->releasing = 1;
+  for (i = 0; i < count; i++) {
+    p = &info->pending[i];
+    info->staging = p->staging;
+    deliver = !info->coalesce || !OPC_IS_PIXELS(p->command) ||
+        latest[p->channel] == i;
+    info->stats.dropped += !deliver;
+    opc_dispatch(info, p->channel, p->command, p->data, p->length, handler,
+                 deliver);
+  }
+  info->releasing = 0;
+  info->staging = staging;
+
+  /* Move the released entries, with their buffers, behind the rest. */
+  memcpy(released, info->pending, count*sizeof(opc_pending));
+  memmove(info->pending, info->pending + count,
+          (info->num_pending - count)*sizeof(opc_pending));
+  memcpy(info->pending + info->num_pending - count, released,
+         count*sizeof(opc_pending));
+  info->num_pending -= count;
+}
+
+/* Acts on the pending timed messages that are due.  Returns the number */
+/* acted on. */
+static int opc_release_due(opc_source_info* info, opc_handler* handler) {
+  u64 now = opc_clock_us();
+  int count;
+
+  for (count = 0; count < info->num_pending &&
+       info->pending[count].time_us <= now; count++);
+  if (count > 0) {
+    opc_release_pending(info, count, handler);
+  }
+  return count;
+}
+
+/* Returns 1 if an OPC_TIMED payload wraps something other than pixel */
+/* data, a stream sync, or a compressed message that itself wraps pixel */
+/* data.  Any deeper nesting could bring a released message back here */
+/* while the queue is being worked through. */
+static u8 opc_is_nested_timed(u8* payload, u32 length) {
+  u8* wrapped = payload + OPC_TIMED_HEADER_LENGTH;
+
+  if (payload[0] == OPC_TIMED) {
+    return 1;
+  }
+  return payload[0] == OPC_COMPRESSED &&
+      length > OPC_TIMED_HEADER_LENGTH && OPC_IS_WRAPPER(wrapped[0]);
+}
+
+/* Acts on an OPC_TIMED message: at once if it is due (or implausibly far */
+/* ahead), or else by queueing a copy of the wrapped message. */
+static void opc_schedule(opc_source_info* info, u8 channel, u8* payload,
+                         u32 length, opc_handler* handler, u8 deliver) {
+  u64 time_us = 0;
+  u64 now = opc_clock_us();
+  opc_pending spare;
+  u8* data;
+  int i;
+
+  /* Nothing released from the queue can queue more (see above). */
+  if (length < OPC_TIMED_HEADER_LENGTH ||
+      opc_is_nested_timed(payload, length) || info->releasing) {
+    fprintf(stderr, "OPC: Malformed timed message for channel %d\n", channel);
+    info->stats.dropped += deliver;  /* if not, it is counted already */
+    return;
+  }
+  for (i = 1; i < OPC_TIMED_HEADER_LENGTH; i++) {
+    time_us = (time_us << 8) | payload[i];
+  }
+  if (time_us <= now || time_us - now > OPC_MAX_SCHEDULE_US) {
+    opc_dispatch(info, channel, payload[0], payload + OPC_TIMED_HEADER_LENGTH,
+                 length - OPC_TIMED_HEADER_LENGTH, handler, deliver);
+    return;
+  }
+  if (info->num_pending == OPC_MAX_PENDING) {
+    opc_release_pending(info, 1, handler);
+  }
+
+  /* Copy into the spare entry, then insert it in order of time. */
+  spare = info->pending[info->num_pending];
+  length -= OPC_TIMED_HEADER_LENGTH;
+  if (spare.capacity < length) {
+    data = realloc(spare.data, length);
+    if (!data) {
+      fprintf(stderr, "OPC: Out of memory for timed message\n");
+      return;
+    }
+    spare.data = data;
+    spare.capacity = length;
+  }
+  spare.time_us = time_us;
+  spare.channel = channel;
+  spare.command = payload[0];
+  spare.staging = info->staging;
+  spare.length = length;
+  memcpy(spare.data, payload + OPC_TIMED_HEADER_LENGTH, length);
+  for (i = info->num_pending;
+       i > 0 && info->pending[i - 1].time_us > time_us; i--) {
+    info->pending[i] = info->pending[i - 1];
+  }
+  info->pending[i] = spare;
+  info->num_pending++;
+}
+
+/* Acts on one complete message, updating the channel's retained frame if */
+/* it has one.  If deliver is set, calls the handler for pixel data (or */
+/* stages it, if the source is staging). */
+static void opc_dispatch(opc_source_info* info, u8 channel, u8 command,
+                         u8* payload, u32 length, opc_handler* handler,
+                         u8 deliver) {
+  switch (command) {
+    case OPC_SET_PIXELS:
+      /* The payload limit has slack for wrapper headers; no frame does. */
+      if (length > OPC_MAX_PIXELS_PER_FRAME*3) {
+        length = OPC_MAX_PIXELS_PER_FRAME*3;
+      }
+      if (info->frames[channel] &&
+          opc_resize_frame(info, channel, length/3)) {
+        memcpy(info->frames[channel], payload, length/3*3);
+      }
+      if (deliver) {
+        opc_deliver(info, handler, channel, length/3, (pixel*) payload);
+      }
+      break;
+    case OPC_SET_PIXEL_SPANS:
+      if (!opc_apply_spans(info, channel, payload, length)) {
+        fprintf(stderr, "OPC: Malformed spans for channel %d\n", channel);
+      } else if (deliver) {
+        opc_deliver(info, handler, channel, info->frame_counts[channel],
+                    info->frames[channel]);
+      }
+      break;
+    case OPC_SET_PIXELS_16:
+    case OPC_SET_PIXELS_16_RGBW:
+      opc_dispatch16(info, channel,
+                     command == OPC_SET_PIXELS_16_RGBW,
+                     payload, length, handler, deliver);
+      break;
+    case OPC_TIMED:
+      opc_schedule(info, channel, payload, length, handler, deliver);
+      break;
+    case OPC_COMPRESSED:
+      if (!opc_decompress(info, payload, length, &length)) {
+        fprintf(stderr, "OPC: Malformed compressed message for channel %d\n",
+                channel);
+        info->stats.dropped += deliver;  /* if not, it is counted already */
+      } else {
+        opc_dispatch(info, channel, payload[0], info->decoded, length,
+                     handler, deliver);
+      }
+      break;
+    case OPC_STREAM_SYNC:
+      if (opc_is_sync(command, payload, length)) {
+        opc_commit(info, handler);
+      }
+      break;
+  }
+}
+
+/* Dispatches every complete message in a connection's buffer, calling */
+/* the handler for each pixel data packet.  If the source coalesces, the */
+/* handler is not called for a pixel data packet when a newer one for the */
+/* same channel is already in the buffer, so only the latest frame for */
+/* each channel is delivered.  Returns 0 if a message is too long to ever */
+/* fit in the buffer. */
+static u8 opc_parse_messages(
+    opc_source_info* info, opc_connection* conn, opc_handler* handler) {
+  u32 latest[256];
+  u8* header;
+  u32 header_length;
+  u32 payload_length;
+  u32 offset;
+  u32 end;
+  u8 deliver;
+  u8 ok = 1;
+
+  /* Find the end of the last complete message. */
+  for (offset = conn->start; conn->end - offset >= 4; offset = end) {
+    header = conn->buffer + offset;
+    header_length = OPC_HEADER_LENGTH(header);
+    if (conn->end - offset < header_length) {
+      break;  /* header incomplete */
+    }
+    payload_length = OPC_PAYLOAD_LENGTH(header);
+    if (payload_length > OPC_MAX_PAYLOAD_LENGTH) {
+      fprintf(stderr, "OPC: Message too long (%u > %d bytes)\n",
+              payload_length, OPC_MAX_PAYLOAD_LENGTH);
+      ok = 0;
+      break;
+    }
+    end = offset + header_length + payload_length;
+    if (end > conn->end) {
+      break;  /* payload incomplete */
+    }
+    if (info->coalesce && OPC_IS_PIXELS(OPC_COMMAND(header))) {
+      latest[header[0]] = offset;
+    }
+  }
+  end = offset;
+
+  for (offset = conn->start; offset < end;
+       offset += header_length + payload_length) {
+    header = conn->buffer + offset;
+    header_length = OPC_HEADER_LENGTH(header);
+    payload_length = OPC_PAYLOAD_LENGTH(header);
+    deliver = !info->coalesce || !OPC_IS_PIXELS(OPC_COMMAND(header)) ||
+        latest[header[0]] == offset;
+    info->stats.messages++;
+    info->stats.dropped += !deliver;
+    opc_set_staging(info, conn, header, header_length, payload_length);
+    opc_dispatch(info, header[0], OPC_COMMAND(header), header + header_length,
+                 payload_length, handler, deliver);
+  }
+  conn->start = end;
+  if (conn->start == conn->end) {
+    conn->start = conn->end = 0;
+  } else if (conn->end == OPC_RECV_BUFFER_SIZE) {
+    memmove(conn->buffer, conn->buffer + conn->start, conn->end - conn->start);
+    conn->end -= conn->start;
+    conn->start = 0;
+  }
+  return ok;
+}
+
+/* Reads as much data as is available on a connection (up to the free */
+/* space in its buffer) with a single recv, then dispatches all complete */
+/* messages.  Returns 0 if the connection was closed by the peer or must */
+/* be closed because it sent an oversized message. */
+static u8 opc_recv_connection(
+    opc_source_info* info, opc_connection* conn, opc_handler* handler) {
+  ssize_t received;
+
+  received = recv(conn->sock, conn->buffer + conn->end,
+                  OPC_RECV_BUFFER_SIZE - conn->end, 0);
+  if (received < 0 && errno == EINTR) {
+    return 1;
+  }
+  if (received <= 0) {
+    return 0;
+  }
+  OPC_MARK(info, complete_ns);
+  conn->end += received;
+  info->stats.bytes += received;
+  return opc_parse_messages(info, conn, handler);
+}
+
+static u8 opc_receive_single(
+    opc_source_info* info, opc_handler* handler, u32 timeout_ms) {
   int nfds;
   fd_set readfds;
   struct timeval timeout;
-  opc_source_info* info = &opc_sources[source];
   struct sockaddr_in address;
   socklen_t address_len = sizeof(address);
-  u16 payload_expected;
-  ssize_t received = 1;  /* nonzero, because we treat zero to mean "closed" */
   char buffer[64];
 
-  if (source < 0 || source >= opc_next_source) {
-    fprintf(stderr, "OPC: Source %d does not exist\n", source);
-    return 0;
-  }
-
   /* Select for inbound data or connections. */
   FD_ZERO(&readfds);
   if (info->listen_sock >= 0) {
     FD_SET(info->listen_sock, &readfds);
     nfds = info->listen_sock + 1;
-  } else if (info->sock >= 0) {
-    FD_SET(info->sock, &readfds);
-    nfds = info->sock + 1;
+  } else if (info->conn.sock >= 0) {
+    FD_SET(info->conn.sock, &readfds);
+    nfds = info->conn.sock + 1;
   }
   timeout.tv_sec = timeout_ms/1000;
   timeout.tv_usec = (timeout_ms % 1000)*1000;
   select(nfds, &readfds, NULL, NULL, &timeout);
+  OPC_MARK(info, readable_ns);
   if (info->listen_sock >= 0 && FD_ISSET(info->listen_sock, &readfds)) {
     /* Handle an inbound connection. */
-    info->sock = accept(
+    info->conn.sock = accept(
         info->listen_sock, (struct sockaddr*) &(address), &address_len);
     inet_ntop(AF_INET, &(address.sin_addr), buffer, 64);
     fprintf(stderr, "OPC: Client connected from %s\n", buffer);
     close(info->listen_sock);
     info->listen_sock = -1;
-    info->header_length = 0;
-    info->payload_length = 0;
-  } else if (info->sock >= 0 && FD_ISSET(info->sock, &readfds)) {
+    info->conn.start = 0;
+    info->conn.end = 0;
+    info->conn.synced = 0;
+  } else if (info->conn.sock >= 0 && FD_ISSET(info->conn.sock, &readfds)) {
     /* Handle inbound data on an existing connection. */
-    if (info->header_length < 4) {  /* need header */
-      received = recv(info->sock, info->header + info->header_length,
-                      4 - info->header_length, 0);
-      if (received > 0) {
-        info->header_length += received;
-      }
-    }
-    if (info->header_length == 4) {  /* header complete */
-      payload_expected = (info->header[2] << 8) | info->header[3];
-      if (info->payload_length < payload_expected) {  /* need payload */
-        received = recv(info->sock, info->payload + info->payload_length,
-                        payload_expected - info->payload_length, 0);
-        if (received > 0) {
-          info->payload_length += received;
-        }
-      }
-      if (info->header_length == 4 &&
-          info->payload_length == payload_expected) {  /* payload complete */
-        switch (info->header[1]) {
-          case OPC_SET_PIXELS:
-            handler(info->header[0], payload_expected/3,
-                    (pixel*) info->payload);
-            break;
-          case OPC_STREAM_SYNC:
-            break;
-        }
-        info->header_length = 0;
-        info->payload_length = 0;
-      }
-    }
-    if (received <= 0) {
+    if (!opc_recv_connection(info, &(info->conn), handler)) {
       /* Connection was closed; wait for more connections. */
       fprintf(stderr, "OPC: Client closed connection\n");
-      close(info->sock);
-      info->sock = -1;
+      close(info->conn.sock);
+      info->conn.sock = -1;
+      opc_unstage(info, &info->conn);
       info->listen_sock = opc_listen(info->port);
     }
   } else {
@@ -164,17 +929,394 @@ u8 opc_receive(opc_source source, opc_handler* handler, u32 timeout_ms) {
   return 1;
 }
 
+#ifdef __linux__
+/* Accepts a pending connection on a multi-connection source. */
+static void opc_accept_multi(opc_source_info* info) {
+  struct sockaddr_in address;
+  socklen_t address_len = sizeof(address);
+  struct epoll_event event;
+  char buffer[64];
+  opc_connection* conn;
+  int sock;
+  int c;
+
+  sock = accept(info->listen_sock, (struct sockaddr*) &(address), &address_len);
+  if (sock < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      perror("OPC: Could not accept connection");
+    }
+    return;
+  }
+  inet_ntop(AF_INET, &(address.sin_addr), buffer, 64);
+  for (c = 0; c < OPC_MAX_CONNECTIONS && info->conns[c]; c++);
+  if (c == OPC_MAX_CONNECTIONS) {
+    fprintf(stderr, "OPC: Refused client from %s (limit of %d reached)\n",
+            buffer, OPC_MAX_CONNECTIONS);
+    close(sock);
+    return;
+  }
+  conn = malloc(sizeof(opc_connection));
+  if (conn) {
+    conn->buffer = malloc(OPC_RECV_BUFFER_SIZE);
+    if (!conn->buffer) {
+      free(conn);
+      conn = NULL;
+    }
+  }
+  if (!conn) {
+    fprintf(stderr, "OPC: Out of memory for client from %s\n", buffer);
+    close(sock);
+    return;
+  }
+  conn->sock = sock;
+  conn->start = 0;
+  conn->end = 0;
+  conn->synced = 0;
+  conn->staged = NULL;
+  event.events = EPOLLIN;
+  event.data.u32 = c;
+  epoll_ctl(info->epoll_fd, EPOLL_CTL_ADD, sock, &event);
+  info->conns[c] = conn;
+  fprintf(stderr, "OPC: Client connected from %s\n", buffer);
+}
+
+/* Closes one connection of a multi-connection source. */
+static void opc_close_multi(opc_source_info* info, int c) {
+  opc_connection* conn = info->conns[c];
+
+  epoll_ctl(info->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+  close(conn->sock);
+  opc_unstage(info, conn);
+  free(conn->buffer);
+  free(conn);
+  info->conns[c] = NULL;
+}
+
+static u8 opc_receive_multi(
+    opc_source_info* info, opc_handler* handler, u32 timeout_ms) {
+  struct epoll_event events[OPC_MAX_EVENTS];
+  int n;
+  int e;
+  u32 c;
+
+  n = epoll_wait(info->epoll_fd, events, OPC_MAX_EVENTS, timeout_ms);
+  if (n <= 0) {
+    /* timeout_ms milliseconds passed with no incoming data or connections. */
+    return 0;
+  }
+  OPC_MARK(info, readable_ns);
+  for (e = 0; e < n; e++) {
+    c = events[e].data.u32;
+    if (c == OPC_LISTEN_TAG) {
+      opc_accept_multi(info);
+    } else if (info->conns[c] &&
+               !opc_recv_connection(info, info->conns[c], handler)) {
+      fprintf(stderr, "OPC: Client closed connection\n");
+      opc_close_multi(info, c);
+    }
+  }
+  return 1;
+}
+#endif
+
+/* Fetches up to OPC_MAX_DATAGRAMS waiting datagrams without blocking, */
+/* storing their lengths in lengths[].  Returns the number fetched. */
+static int opc_recv_datagrams(opc_source_info* info, u32* lengths) {
+  int n = 0;
+#ifdef __linux__
+  struct mmsghdr msgs[OPC_MAX_DATAGRAMS];
+  struct iovec iov[OPC_MAX_DATAGRAMS];
+  int d;
+
+  bzero(msgs, sizeof(msgs));
+  for (d = 0; d < OPC_MAX_DATAGRAMS; d++) {
+    iov[d].iov_base = info->datagrams + d*OPC_MAX_DATAGRAM_SIZE;
+    iov[d].iov_len = OPC_MAX_DATAGRAM_SIZE;
+    msgs[d].msg_hdr.msg_iov = &iov[d];
+    msgs[d].msg_hdr.msg_iovlen = 1;
+  }
+  n = recvmmsg(info->conn.sock, msgs, OPC_MAX_DATAGRAMS, MSG_DONTWAIT, NULL);
+  for (d = 0; d < n; d++) {
+    lengths[d] = msgs[d].msg_len;
+  }
+#else
+  ssize_t received;
+
+  while (n < OPC_MAX_DATAGRAMS) {
+    received = recv(info->conn.sock, info->datagrams + n*OPC_MAX_DATAGRAM_SIZE,
+                    OPC_MAX_DATAGRAM_SIZE, MSG_DONTWAIT);
+    if (received < 0) break;
+    lengths[n++] = received;
+  }
+#endif
+  return n < 0 ? 0 : n;
+}
+
+static u8 opc_receive_udp(
+    opc_source_info* info, opc_handler* handler, u32 timeout_ms) {
+  fd_set readfds;
+  struct timeval timeout;
+  u32 lengths[OPC_MAX_DATAGRAMS];
+  int latest[256];
+  u8* header;
+  u32 header_length;
+  u8 deliver;
+  int n;
+  int d;
+
+  /* Wait for the first datagram, then take everything that is queued. */
+  FD_ZERO(&readfds);
+  FD_SET(info->conn.sock, &readfds);
+  timeout.tv_sec = timeout_ms/1000;
+  timeout.tv_usec = (timeout_ms % 1000)*1000;
+  if (select(info->conn.sock + 1, &readfds, NULL, NULL, &timeout) <= 0) {
+    /* timeout_ms milliseconds passed with no incoming data. */
+    return 0;
+  }
+  OPC_MARK(info, readable_ns);
+  n = opc_recv_datagrams(info, lengths);
+  OPC_MARK(info, complete_ns);
+
+  /* Each datagram carries exactly one message; drop any that are short. */
+  for (d = 0; d < n; d++) {
+    header = info->datagrams + d*OPC_MAX_DATAGRAM_SIZE;
+    header_length = lengths[d] < 4 ? 8 : OPC_HEADER_LENGTH(header);
+    info->stats.messages++;
+    info->stats.bytes += lengths[d];
+    if (lengths[d] < header_length ||
+        lengths[d] != header_length + OPC_PAYLOAD_LENGTH(header)) {
+      lengths[d] = 0;
+      info->stats.dropped++;
+    } else if (info->coalesce && OPC_IS_PIXELS(OPC_COMMAND(header))) {
+      latest[header[0]] = d;
+    }
+  }
+  for (d = 0; d < n; d++) {
+    header = info->datagrams + d*OPC_MAX_DATAGRAM_SIZE;
+    header_length = OPC_HEADER_LENGTH(header);
+    if (lengths[d]) {
+      deliver = !info->coalesce || !OPC_IS_PIXELS(OPC_COMMAND(header)) ||
+          latest[header[0]] == d;
+      info->stats.dropped += !deliver;
+      opc_set_staging(info, &info->conn, header, header_length,
+                      lengths[d] - header_length);
+      opc_dispatch(info, header[0], OPC_COMMAND(header), header + header_length,
+                   lengths[d] - header_length, handler, deliver);
+    }
+  }
+  return 1;
+}
+
+/* Returns 1 if a shared-memory slot of the given length holds exactly one */
+/* whole message. */
+static u8 opc_is_whole_slot(u8* header, u32 length) {
+  u32 header_length = length < 4 ? 8 : OPC_HEADER_LENGTH(header);
+
+  return length >= header_length &&
+      length == header_length + OPC_PAYLOAD_LENGTH(header);
+}
+
+static u8 opc_receive_shm(
+    opc_source_info* info, opc_handler* handler, u32 timeout_ms) {
+  u32 latest[256];
+  u32 length;
+  u32 header_length;
+  u8* header;
+  u8 deliver;
+  u32 n;
+  u32 i;
+
+  n = shm_wait(info->ring, timeout_ms);
+  if (n == 0) {
+    /* timeout_ms milliseconds passed with no incoming data. */
+    return 0;
+  }
+  OPC_MARK(info, readable_ns);
+  OPC_MARK(info, complete_ns);
+  if (info->coalesce) {
+    for (i = 0; i < n; i++) {
+      header = shm_peek(info->ring, i, &length);
+      if (header && opc_is_whole_slot(header, length) &&
+          OPC_IS_PIXELS(OPC_COMMAND(header))) {
+        latest[header[0]] = i;
+      }
+    }
+  }
+
+  /* Hand the handler pointers straight into the shared slots. */
+  for (i = 0; i < n; i++) {
+    header = shm_peek(info->ring, i, &length);
+    info->stats.messages++;
+    if (!header) {
+      info->stats.dropped++;
+      continue;
+    }
+    header_length = length < 4 ? 8 : OPC_HEADER_LENGTH(header);
+    info->stats.bytes += length;
+    if (opc_is_whole_slot(header, length)) {
+      deliver = !info->coalesce || !OPC_IS_PIXELS(OPC_COMMAND(header)) ||
+          latest[header[0]] == i;
+      info->stats.dropped += !deliver;
+      opc_set_staging(info, &info->conn, header, header_length,
+                      length - header_length);
+      opc_dispatch(info, header[0], OPC_COMMAND(header), header + header_length,
+                   length - header_length, handler, deliver);
+    } else {
+      info->stats.dropped++;
+    }
+  }
+  shm_release(info->ring, n);
+  return 1;
+}
+
+/* Waits up to timeout_ms for I/O on a source and handles it. */
+static u8 opc_receive_io(
+    opc_source_info* info, opc_handler* handler, u32 timeout_ms) {
+#ifdef __linux__
+  if (info->type == OPC_SOURCE_TYPE_MULTI) {
+    return opc_receive_multi(info, handler, timeout_ms);
+  }
+#endif
+  if (info->type == OPC_SOURCE_TYPE_UDP) {
+    return opc_receive_udp(info, handler, timeout_ms);
+  }
+  if (info->type == OPC_SOURCE_TYPE_SHM) {
+    return opc_receive_shm(info, handler, timeout_ms);
+  }
+  return opc_receive_single(info, handler, timeout_ms);
+}
+
+u8 opc_receive(opc_source source, opc_handler* handler, u32 timeout_ms) {
+  opc_source_info* info = &opc_sources[source];
+#ifdef __linux__
+  struct timespec due;
+#endif
+  u64 now;
+  u64 next;
+  u8 result;
+
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return 0;
+  }
+
+  /* Wake up in time for the next timed message, if there is one. */
+  if (info->num_pending > 0) {
+    now = opc_clock_us();
+    next = info->pending[0].time_us;
+    if (next <= now) {
+      timeout_ms = 0;
+    } else if ((next - now)/1000 < timeout_ms) {
+      timeout_ms = (next - now)/1000;
+    }
+  }
+  result = opc_receive_io(info, handler, timeout_ms);
+
+  /* The wait only has millisecond resolution, so sleep out the rest. */
+  if (info->num_pending > 0) {
+    now = opc_clock_us();
+    next = info->pending[0].time_us;
+    if (next > now && next - now < 1000) {
+#ifdef __linux__
+      due.tv_sec = next/1000000;
+      due.tv_nsec = (next % 1000000)*1000;
+      while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &due, NULL) ==
+             EINTR);
+#else
+      usleep(next - now);
+#endif
+    }
+    if (opc_release_due(info, handler) > 0) {
+      result = 1;
+    }
+  }
+  return result;
+}
+
+void opc_set_coalescing(opc_source source, u8 coalesce) {
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return;
+  }
+  opc_sources[source].coalesce = coalesce;
+}
+
+void opc_set_handler16(opc_source source, opc_handler16* handler16) {
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return;
+  }
+  opc_sources[source].handler16 = handler16;
+}
+
+void opc_set_sync_handler(opc_source source, opc_sync_handler* sync_handler) {
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return;
+  }
+  opc_sources[source].sync_handler = sync_handler;
+}
+
+u8 opc_is_staged(opc_source source) {
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return 0;
+  }
+  return opc_sources[source].committing;
+}
+
+void opc_get_stats(opc_source source, opc_stats* stats) {
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return;
+  }
+  *stats = opc_sources[source].stats;
+}
+
+void opc_set_timing(opc_source source, u8 timing) {
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return;
+  }
+  opc_sources[source].timing = timing;
+}
+
+void opc_get_times(opc_source source, opc_times* times) {
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return;
+  }
+  *times = opc_sources[source].times;
+}
+
 void opc_reset_source(opc_source source) {
   opc_source_info* info = &opc_sources[source];
+  int c;
+
   if (source < 0 || source >= opc_next_source) {
     fprintf(stderr, "OPC: Source %d does not exist\n", source);
     return;
   }
 
-  if (info->sock >= 0) {
+#ifdef __linux__
+  if (info->type == OPC_SOURCE_TYPE_MULTI) {
+    for (c = 0; c < OPC_MAX_CONNECTIONS; c++) {
+      if (info->conns[c]) {
+        fprintf(stderr, "OPC: Closed connection\n");
+        opc_close_multi(info, c);
+      }
+    }
+    return;
+  }
+#endif
+  if (info->type == OPC_SOURCE_TYPE_UDP || info->type == OPC_SOURCE_TYPE_SHM) {
+    return;  /* there is no connection to reset */
+  }
+  if (info->conn.sock >= 0) {
     fprintf(stderr, "OPC: Closed connection\n");
-    close(info->sock);
-    info->sock = -1;
+    close(info->conn.sock);
+    info->conn.sock = -1;
+    opc_unstage(info, &info->conn);
     info->listen_sock = opc_listen(info->port);
   }
 }
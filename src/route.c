@@ -0,0 +1,312 @@
+/* Copyright 2016 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cJSON.h"
+#include "opc.h"
+#include "route.h"
+
+/* A route as given in the file, before it is compiled into a step */
+typedef struct {
+  u8 channel;
+  u32 first;
+  u32 count;
+  u8 output;
+  u32 offset;
+  u32 index;
+} route_entry;
+
+static char* route_read_file(char* filename) {
+  FILE* fp;
+  struct stat st;
+  char* buffer;
+
+  if (stat(filename, &st) != 0 || !(fp = fopen(filename, "r"))) {
+    return NULL;
+  }
+  buffer = malloc(st.st_size + 1);
+  if (buffer) {
+    buffer[fread(buffer, 1, st.st_size, fp)] = 0;
+  }
+  fclose(fp);
+  return buffer;
+}
+
+/* Returns a number from a JSON object, or fallback if it has none. */
+static int route_get_int(cJSON* object, char* name, int fallback) {
+  cJSON* item = cJSON_GetObjectItem(object, name);
+  return item && item->type == cJSON_Number ? item->valueint : fallback;
+}
+
+/* Returns a string from a JSON object, or NULL if it has none. */
+static char* route_get_string(cJSON* object, char* name) {
+  cJSON* item = cJSON_GetObjectItem(object, name);
+  return item && item->type == cJSON_String ? item->valuestring : NULL;
+}
+
+/* Reads the outputs from the JSON into the table, without opening them. */
+static u8 route_load_outputs(route_table* table, cJSON* list) {
+  route_output* out;
+  cJSON* item;
+  char* path;
+  char* name;
+  int n = list ? cJSON_GetArraySize(list) : 0;
+  int i;
+
+  if (n < 1 || n > ROUTE_MAX_OUTPUTS) {
+    fprintf(stderr, "Need from 1 to %d outputs\n", ROUTE_MAX_OUTPUTS);
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    item = cJSON_GetArrayItem(list, i);
+    out = &table->outputs[i];
+    path = route_get_string(item, "path");
+    name = route_get_string(item, "driver");
+    if (!path || !name || !(out->drv = driver_find(name))) {
+      fprintf(stderr, "Output %d needs a path and a known driver\n", i);
+      return 0;
+    }
+    if (!(out->path = strdup(path))) {
+      return 0;
+    }
+    table->num_outputs = i + 1;
+    out->speed_hz = route_get_int(item, "mhz", 0)*1000000;
+    if (!out->speed_hz) {
+      out->speed_hz = out->drv->speed_hz;
+    }
+    out->delay_us = route_get_int(item, "delay", out->drv->delay_us);
+    out->order = out->drv->order;
+    out->rgbw = 0;
+    name = route_get_string(item, "order");
+    if (name && (!encode_parse_order(name, &out->order, &out->rgbw) ||
+                 !encode_get(out->drv->chipset, out->order, out->rgbw))) {
+      fprintf(stderr, "Output %d: unsupported color order %s\n", i, name);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Reads the routes from the JSON, checking them against the outputs and */
+/* extending each output's length to cover the routes to it. */
+static route_entry* route_load_entries(route_table* table, cJSON* list) {
+  route_entry* entries;
+  route_entry* e;
+  cJSON* item;
+  int channel;
+  int output;
+  int first;
+  int count;
+  int offset;
+  u32 i;
+
+  table->num_steps = list ? cJSON_GetArraySize(list) : 0;
+  entries = calloc(table->num_steps + 1, sizeof(route_entry));
+  if (!entries) {
+    return NULL;
+  }
+  for (i = 0; i < table->num_steps; i++) {
+    item = cJSON_GetArrayItem(list, i);
+    e = &entries[i];
+    channel = route_get_int(item, "channel", 0);
+    output = route_get_int(item, "output", -1);
+    first = route_get_int(item, "first", 0);
+    count = route_get_int(item, "count", 0);
+    offset = route_get_int(item, "offset", 0);
+    /* Compared this way round, none of these checks can overflow. */
+    if (channel < 1 || channel > 255 || output < 0 ||
+        output >= table->num_outputs || first < 0 || offset < 0 ||
+        count < 1 || count > OPC_MAX_PIXELS_PER_FRAME ||
+        first > OPC_MAX_PIXELS_PER_FRAME - count ||
+        offset > OPC_MAX_PIXELS_PER_FRAME - count) {
+      fprintf(stderr, "Route %d needs a channel from 1 to 255, an output, "
+              "and a count, within %d pixels\n", i, OPC_MAX_PIXELS_PER_FRAME);
+      free(entries);
+      return NULL;
+    }
+    e->channel = channel;
+    e->output = output;
+    e->first = first;
+    e->count = count;
+    e->offset = offset;
+    e->index = i;
+    if (e->offset + e->count > table->outputs[output].length) {
+      table->outputs[output].length = e->offset + e->count;
+    }
+  }
+  return entries;
+}
+
+/* Orders routes by channel, keeping the file's order within a channel. */
+static int route_compare_entries(const void* a, const void* b) {
+  const route_entry* ea = a;
+  const route_entry* eb = b;
+  return ea->channel != eb->channel ? ea->channel - eb->channel :
+      (int) ea->index - (int) eb->index;
+}
+
+/* Allocates each output's frame, fills it with black, and opens the */
+/* output. */
+static u8 route_open_outputs(route_table* table) {
+  route_output* out;
+  pixel* black;
+  int i;
+
+  black = calloc(OPC_MAX_PIXELS_PER_FRAME, sizeof(pixel));
+  if (!black) {
+    return 0;
+  }
+  for (i = 0; i < table->num_outputs; i++) {
+    out = &table->outputs[i];
+    out->size = out->drv->start_bytes + out->drv->end_bytes +
+        out->length*ENCODE_PIXEL_SIZE(out->drv->chipset, out->rgbw);
+    out->frame = calloc(out->size, 1);
+    if (!out->frame) {
+      free(black);
+      return 0;
+    }
+    encode_get(out->drv->chipset, out->order, out->rgbw)(
+        out->frame + out->drv->start_bytes, black, out->length);
+    out->fd = out->drv->open(out->path, out->speed_hz);
+    if (out->fd < 0) {
+      free(black);
+      return 0;
+    }
+    fprintf(stderr, "Output %s: %s, %s%s, %d pixels, %.2f MHz\n", out->path,
+            out->drv->name, encode_order_name(out->order),
+            out->rgbw ? "w" : "", out->length, out->speed_hz*1e-6);
+  }
+  free(black);
+  return 1;
+}
+
+/* Turns the sorted routes into steps and indexes them by channel. */
+static void route_compile(route_table* table, route_entry* entries) {
+  route_entry* e;
+  route_step* step;
+  route_output* out;
+  u32 i;
+  int c = 0;
+
+  for (i = 0; i < table->num_steps; i++) {
+    e = &entries[i];
+    step = &table->steps[i];
+    out = &table->outputs[e->output];
+    while (c <= e->channel) {
+      table->starts[c++] = i;
+    }
+    step->first = e->first;
+    step->count = e->count;
+    step->output = e->output;
+    step->encode = encode_get(out->drv->chipset, out->order, out->rgbw);
+    step->out = out->frame + out->drv->start_bytes +
+        e->offset*ENCODE_PIXEL_SIZE(out->drv->chipset, out->rgbw);
+  }
+  while (c <= 256) {
+    table->starts[c++] = table->num_steps;
+  }
+}
+
+/* Closes the outputs of a table, partly loaded or not, and frees it. */
+static void route_free(route_table* table) {
+  route_output* out;
+  int i;
+
+  for (i = 0; i < table->num_outputs; i++) {
+    out = &table->outputs[i];
+    if (out->fd >= 0) {
+      close(out->fd);
+    }
+    free(out->frame);
+    free(out->path);
+  }
+  free(table->steps);
+  free(table);
+}
+
+route_table* route_load(char* filename) {
+  route_table* table;
+  route_entry* entries = NULL;
+  char* buffer;
+  cJSON* json;
+  u8 ok;
+  int i;
+
+  buffer = route_read_file(filename);
+  if (!buffer) {
+    fprintf(stderr, "Unable to open '%s'\n", filename);
+    return NULL;
+  }
+  json = cJSON_Parse(buffer);
+  free(buffer);
+  if (!json) {
+    fprintf(stderr, "Unable to parse '%s'\n", filename);
+    return NULL;
+  }
+  table = calloc(1, sizeof(route_table));
+  for (i = 0; table && i < ROUTE_MAX_OUTPUTS; i++) {
+    table->outputs[i].fd = -1;
+  }
+  ok = table &&
+      route_load_outputs(table, cJSON_GetObjectItem(json, "outputs")) &&
+      (entries = route_load_entries(
+          table, cJSON_GetObjectItem(json, "routes"))) &&
+      (table->steps = calloc(table->num_steps + 1, sizeof(route_step))) &&
+      route_open_outputs(table);
+  cJSON_Delete(json);
+  if (!ok) {
+    fprintf(stderr, "Could not load routes from '%s'\n", filename);
+    free(entries);
+    if (table) {
+      route_free(table);
+    }
+    return NULL;
+  }
+  qsort(entries, table->num_steps, sizeof(route_entry),
+        route_compare_entries);
+  route_compile(table, entries);
+  free(entries);
+  return table;
+}
+
+void route_put_pixels(route_table* table, u8 channel, u32 count,
+                      pixel* pixels) {
+  route_step* step = table->steps + (channel ? table->starts[channel] : 0);
+  route_step* end = table->steps +
+      (channel ? table->starts[channel + 1] : table->num_steps);
+
+  for (; step < end; step++) {
+    if (count > step->first) {
+      step->encode(step->out, pixels + step->first,
+                   count - step->first < step->count ?
+                   count - step->first : step->count);
+      table->outputs[step->output].dirty = 1;
+    }
+  }
+}
+
+void route_flush(route_table* table) {
+  route_output* out;
+  int i;
+
+  for (i = 0; i < table->num_outputs; i++) {
+    out = &table->outputs[i];
+    if (out->dirty) {
+      out->drv->write(out->fd, out->speed_hz, out->frame, out->size,
+                      out->delay_us);
+      out->dirty = 0;
+    }
+  }
+}
@@ -0,0 +1,85 @@
+/* Copyright 2016 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// A routing table that sends ranges of pixels on each OPC channel to
+// ranges of pixels on LED strips attached to several outputs, each of which
+// may use a different driver (see driver.h).
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include "driver.h"
+#include "encode.h"
+#include "types.h"
+
+#define ROUTE_MAX_OUTPUTS 16
+
+/* An output and the frame sent to it: the driver's start bytes, then */
+/* length encoded pixels, then the driver's end bytes. */
+typedef struct {
+  char* path;
+  int fd;
+  driver* drv;
+  order_t order;
+  u8 rgbw;
+  u32 speed_hz;
+  u16 delay_us;
+  u32 length;
+  u32 size;
+  u8* frame;
+  u8 dirty;
+} route_output;
+
+/* One route, compiled down to what it takes to apply it: encode count */
+/* pixels of the message, starting at pixel first, into out (which points */
+/* into the frame of the given output). */
+typedef struct {
+  u32 first;
+  u32 count;
+  encode_func* encode;
+  u8* out;
+  u8 output;
+} route_step;
+
+/* The steps are sorted by channel; those for channel c (1 to 255) are */
+/* steps[starts[c]] up to steps[starts[c + 1]].  Channel 0 applies them all. */
+typedef struct {
+  int num_outputs;
+  route_output outputs[ROUTE_MAX_OUTPUTS];
+  u32 num_steps;
+  route_step* steps;
+  u32 starts[257];
+} route_table;
+
+/* Loads a routing table from a JSON file and opens its outputs, e.g.: */
+/*   {"outputs": [{"driver": "apa102", "path": "/dev/spidev0.0"}, */
+/*                {"driver": "ws2801", "path": "/dev/spidev0.1", */
+/*                 "mhz": 2, "order": "grb"}], */
+/*    "routes": [{"channel": 1, "count": 60, "output": 0}, */
+/*               {"channel": 1, "first": 60, "count": 60, "output": 1}, */
+/*               {"channel": 2, "count": 30, "output": 1, "offset": 60}]} */
+/* Each output names a registered driver and a path, and may override the */
+/* driver's speed ("mhz"), color order ("order", e.g. "grbw" for RGBW) and */
+/* pause after each frame ("delay", in microseconds).  Each route sends */
+/* count pixels of a channel, starting at pixel first (default 0), to an */
+/* output (an index into outputs), starting at pixel offset (default 0). */
+/* An output's frame is as long as the routes to it need.  Returns NULL */
+/* on failure. */
+route_table* route_load(char* filename);
+
+/* Encodes the pixels of a message on a channel into the frames of the */
+/* outputs that the channel is routed to, and marks those outputs dirty. */
+void route_put_pixels(route_table* table, u8 channel, u32 count,
+                      pixel* pixels);
+
+/* Sends the frame of every dirty output. */
+void route_flush(route_table* table);
+
+#endif /* ROUTE_H */
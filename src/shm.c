@@ -0,0 +1,152 @@
+/* Copyright 2013 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "shm.h"
+
+#define SHM_SIZE (sizeof(shm_ring) + SHM_NUM_SLOTS*SHM_SLOT_SIZE)
+
+#define shm_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define shm_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* The sizes checked by shm_map are used rather than those in the ring, */
+/* which the other process could change after the check. */
+static u8* shm_slot(shm_ring* ring, u32 i) {
+  return (u8*) (ring + 1) + (i % SHM_NUM_SLOTS)*SHM_SLOT_SIZE;
+}
+
+shm_ring* shm_map(char* name, u8 create) {
+  shm_ring* ring;
+  int fd;
+
+  fd = shm_open(name, create ? O_RDWR | O_CREAT : O_RDWR, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "OPC: Could not open shared memory %s: ", name);
+    perror(NULL);
+    return NULL;
+  }
+  if (create && ftruncate(fd, SHM_SIZE) < 0) {
+    fprintf(stderr, "OPC: Could not size shared memory %s: ", name);
+    perror(NULL);
+    close(fd);
+    return NULL;
+  }
+  ring = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    fprintf(stderr, "OPC: Could not map shared memory %s: ", name);
+    perror(NULL);
+    return NULL;
+  }
+  if (create) {
+    ring->num_slots = SHM_NUM_SLOTS;
+    ring->slot_size = SHM_SLOT_SIZE;
+    ring->head = ring->tail = 0;
+    ring->waiting = 0;
+    shm_store(&ring->magic, SHM_MAGIC);
+  } else if (shm_load(&ring->magic) != SHM_MAGIC ||
+             ring->num_slots != SHM_NUM_SLOTS ||
+             ring->slot_size != SHM_SLOT_SIZE) {
+    fprintf(stderr, "OPC: %s is not an OPC shared memory ring\n", name);
+    munmap(ring, SHM_SIZE);
+    return NULL;
+  }
+  return ring;
+}
+
+void shm_unmap(shm_ring* ring) {
+  munmap(ring, SHM_SIZE);
+}
+
+u8 shm_put(shm_ring* ring, struct iovec* iov, int count) {
+  u32 head = ring->head;
+  u32 tail = shm_load(&ring->tail);
+  u32 length;
+  u8* slot;
+  int i;
+
+  for (i = 0; i < count && head - tail < ring->num_slots; i++, head++) {
+    length = iov[2*i].iov_len + iov[2*i + 1].iov_len;
+    if (length > ring->slot_size - 4) {
+      break;
+    }
+    slot = shm_slot(ring, head);
+    memcpy(slot, &length, 4);
+    memcpy(slot + 4, iov[2*i].iov_base, iov[2*i].iov_len);
+    memcpy(slot + 4 + iov[2*i].iov_len,
+           iov[2*i + 1].iov_base, iov[2*i + 1].iov_len);
+  }
+  if (head != ring->head) {
+    shm_store(&ring->head, head);
+    __atomic_add_fetch(&ring->wake, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+      syscall(SYS_futex, &ring->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+#endif
+  }
+  return i == count;
+}
+
+/* Returns the number of unread slots, which a misbehaving producer cannot */
+/* make more than the ring holds. */
+static u32 shm_ready(shm_ring* ring) {
+  u32 n = shm_load(&ring->head) - ring->tail;
+  return n < SHM_NUM_SLOTS ? n : SHM_NUM_SLOTS;
+}
+
+u32 shm_wait(shm_ring* ring, u32 timeout_ms) {
+  struct timespec timeout;
+  u32 wake;
+
+  if (shm_load(&ring->head) != ring->tail || timeout_ms == 0) {
+    return shm_ready(ring);
+  }
+  wake = __atomic_load_n(&ring->wake, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+  if (shm_load(&ring->head) == ring->tail) {
+    timeout.tv_sec = timeout_ms/1000;
+    timeout.tv_nsec = (timeout_ms % 1000)*1000000;
+    syscall(SYS_futex, &ring->wake, FUTEX_WAIT, wake, &timeout, NULL, 0);
+  }
+#else
+  /* Without futexes, poll the ring once a millisecond. */
+  timeout.tv_sec = 0;
+  timeout.tv_nsec = 1000000;
+  while (shm_load(&ring->head) == ring->tail && timeout_ms--) {
+    nanosleep(&timeout, NULL);
+  }
+#endif
+  __atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+  return shm_ready(ring);
+}
+
+u8* shm_peek(shm_ring* ring, u32 i, u32* length) {
+  u8* slot = shm_slot(ring, ring->tail + i);
+
+  memcpy(length, slot, 4);
+  return *length <= SHM_SLOT_SIZE - 4 ? slot + 4 : NULL;
+}
+
+void shm_release(shm_ring* ring, u32 count) {
+  shm_store(&ring->tail, ring->tail + count);
+}
@@ -0,0 +1,65 @@
+/* Copyright 2013 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// Single-producer, single-consumer ring of OPC messages in shared memory.
+#ifndef SHM_H
+#define SHM_H
+
+#include <sys/uio.h>
+#include "opc.h"
+
+#define SHM_MAGIC 0x4f504352  /* "OPCR" */
+#define SHM_NUM_SLOTS 8
+/* Each slot holds a 4-byte length, then one message of up to */
+/* OPC_MAX_HEADER_LENGTH + OPC_MAX_PAYLOAD_LENGTH bytes. */
+#define SHM_SLOT_SIZE (4 + OPC_MAX_HEADER_LENGTH + OPC_MAX_PAYLOAD_LENGTH)
+
+/* Shared header at the start of the region, followed by the slots.  The */
+/* producer only writes head and the slots from head onward; the consumer */
+/* only writes tail.  Both count upward forever; slot i is i % num_slots. */
+/* wake is bumped after every publish and is the futex the consumer sleeps */
+/* on while waiting is set. */
+typedef struct {
+  u32 magic;
+  u32 num_slots;
+  u32 slot_size;
+  u32 head;
+  u32 tail;
+  u32 wake;
+  u32 waiting;
+} shm_ring;
+
+/* Maps the ring with the given name (e.g. "/opc").  If create is set, */
+/* the region is created if needed and reset to empty.  Returns NULL on */
+/* failure. */
+shm_ring* shm_map(char* name, u8 create);
+
+/* Unmaps a ring mapped by shm_map. */
+void shm_unmap(shm_ring* ring);
+
+/* Copies count messages into free slots and wakes the consumer.  Message i */
+/* is made of iov[2*i] (header) and iov[2*i + 1] (payload).  Returns 1 if */
+/* every message fitted, 0 if the ring filled up and some were dropped. */
+u8 shm_put(shm_ring* ring, struct iovec* iov, int count);
+
+/* Waits up to timeout_ms for the ring to be non-empty.  Returns the number */
+/* of messages ready to read. */
+u32 shm_wait(shm_ring* ring, u32 timeout_ms);
+
+/* Returns a pointer to the i-th unread message (0 is the oldest), which */
+/* stays valid until shm_release; stores its length in *length.  Returns */
+/* NULL if the length the producer gave does not fit in a slot. */
+u8* shm_peek(shm_ring* ring, u32 i, u32* length);
+
+/* Hands the oldest count unread slots back to the producer. */
+void shm_release(shm_ring* ring, u32 count);
+
+#endif /* SHM_H */
@@ -10,53 +10,242 @@ CONDITIONS OF ANY KIND, either express or implied.  See the License for the
 specific language governing permissions and limitations under the License. */
 
 #include "spi.h"
+#include "stats.h"
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
 
-void spi_transfer(int fd, u32 spi_speed_hz, u8* tx, u8* rx, u32 len, u16 delay) {
+/* spidev refuses any SPI_IOC_MESSAGE whose transfers add up to more than */
+/* its bufsiz module parameter, so longer frames are sent as a series of */
+/* messages of up to spi_bufsiz bytes each. */
+static u32 spi_bufsiz = SPI_MAX_WRITE;
+
+/* Reads the spidev bufsiz module parameter, if it is available. */
+static void spi_read_bufsiz() {
+  FILE* f = fopen(SPI_BUFSIZ_PATH, "r");
+  unsigned long bufsiz;
+
+  if (f) {
+    if (fscanf(f, "%lu", &bufsiz) == 1 && bufsiz > 0) {
+      spi_bufsiz = bufsiz;
+    }
+    fclose(f);
+  }
+}
+
+/* Sends len bytes in messages of at most spi_bufsiz bytes, pausing for */
+/* delay microseconds only after the last.  Returns the number of bytes */
+/* handled, which is less than len only if the device stopped accepting */
+/* SPI_IOC_MESSAGE (e.g. it is not spidev at all), so the caller can send */
+/* the rest some other way. */
+static u32 spi_send_messages(int fd, u32 spi_speed_hz, u8* tx, u8* rx,
+                             u32 len, u16 delay) {
   struct spi_ioc_transfer transfer;
-  transfer.tx_buf = (unsigned long) tx;
-  transfer.rx_buf = (unsigned long) rx;
-  transfer.len = len;
-  transfer.delay_usecs = delay;
+  u32 sent = 0;
+  u32 block;
+  int result;
+
+  memset(&transfer, 0, sizeof(transfer));
   transfer.speed_hz = spi_speed_hz;
   transfer.bits_per_word = SPI_BITS_PER_WORD;
-  if (ioctl(fd, SPI_IOC_MESSAGE(1), &transfer) < len) {
-    fprintf(stderr, "Write failed\n");
-  }
+  do {
+    block = len > spi_bufsiz ? spi_bufsiz : len;
+    transfer.tx_buf = (unsigned long) tx;
+    transfer.rx_buf = (unsigned long) rx;
+    transfer.len = block;
+    transfer.delay_usecs = block == len ? delay : 0;
+    result = ioctl(fd, SPI_IOC_MESSAGE(1), &transfer);
+    if (result < 0 && errno == ENOTTY) {
+      return sent;
+    }
+    if (result < (int) block) {
+      fprintf(stderr, "Write failed\n");
+    }
+    tx += block;
+    rx = rx ? rx + block : NULL;
+    len -= block;
+    sent += block;
+  } while (len);
+  return sent;
 }
 
-void spi_write(int fd, u8* tx, u32 len) {
+/* Writes len bytes with plain writes, for devices that are not spidev. */
+static void spi_write_all(int fd, u8* tx, u32 len) {
   int block;
 
   while (len) {
     block = len > SPI_MAX_WRITE ? SPI_MAX_WRITE : len;
     if (write(fd, tx, block) < block) {
       fprintf(stderr, "Write failed\n");
+      return;
     }
     tx += block;
     len -= block;
   }
 }
 
+static void spi_spidev_send(int fd, u32 spi_speed_hz, u8* tx, u8* rx,
+                            u32 len, u16 delay) {
+  u32 sent = spi_send_messages(fd, spi_speed_hz, tx, rx, len, delay);
+
+  /* If this is not a spidev device, write whatever is left plainly. */
+  if (sent < len) {
+    spi_write_all(fd, tx + sent, len - sent);
+  }
+}
+
+/* The built-in backends, each of which ignores the arguments it has no */
+/* use for */
+static int spi_null_open(char* path, u32 spi_speed_hz) {
+  (void) path;
+  (void) spi_speed_hz;
+  return open("/dev/null", O_WRONLY);
+}
+
+static void spi_null_send(int fd, u32 spi_speed_hz, u8* tx, u8* rx,
+                          u32 len, u16 delay) {
+  (void) fd;
+  (void) spi_speed_hz;
+  (void) tx;
+  (void) rx;
+  (void) len;
+  (void) delay;
+}
+
+static int spi_file_open(char* path, u32 spi_speed_hz) {
+  (void) spi_speed_hz;
+  return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+static void spi_file_send(int fd, u32 spi_speed_hz, u8* tx, u8* rx,
+                          u32 len, u16 delay) {
+  (void) spi_speed_hz;
+  (void) rx;
+  (void) delay;
+  spi_write_all(fd, tx, len);
+}
+
+static int spi_throttle_open(char* path, u32 spi_speed_hz) {
+  return *path ? spi_file_open(path, spi_speed_hz) : spi_null_open(path, 0);
+}
+
+/* Takes as long as the frame would take on the wire: 8 clocks a byte, */
+/* then the delay. */
+static void spi_throttle_send(int fd, u32 spi_speed_hz, u8* tx, u8* rx,
+                              u32 len, u16 delay) {
+  u64 ns = (u64) len*8*1000000000/spi_speed_hz + (u64) delay*1000;
+  struct timespec wait;
+
+  (void) rx;
+  spi_write_all(fd, tx, len);
+  wait.tv_sec = ns/1000000000;
+  wait.tv_nsec = ns % 1000000000;
+  while (nanosleep(&wait, &wait) < 0 && errno == EINTR);
+}
+
+static spi_backend spi_builtins[] = {
+  {"null:", spi_null_open, spi_null_send},
+  {"file:", spi_file_open, spi_file_send},
+  {"throttle:", spi_throttle_open, spi_throttle_send}
+};
+
+static spi_backend* spi_backends[SPI_MAX_BACKENDS];
+static int spi_num_backends = -1;
+
+/* The backend (NULL for spidev) and speed each file descriptor was */
+/* opened with */
+static spi_backend* spi_fd_backends[SPI_MAX_FDS];
+static u32 spi_fd_speeds[SPI_MAX_FDS];
+
+/* Starts the list of backends off with the built-in ones. */
+static void spi_init_backends() {
+  int i;
+
+  if (spi_num_backends < 0) {
+    spi_num_backends = sizeof(spi_builtins)/sizeof(spi_backend);
+    for (i = 0; i < spi_num_backends; i++) {
+      spi_backends[i] = &spi_builtins[i];
+    }
+  }
+}
+
+u8 spi_register_backend(spi_backend* backend) {
+  spi_init_backends();
+  if (spi_num_backends >= SPI_MAX_BACKENDS) {
+    return 0;
+  }
+  spi_backends[spi_num_backends++] = backend;
+  return 1;
+}
+
+/* Sends with the backend the device was opened with; a speed of 0 means */
+/* the speed given to init_spidev. */
+static void spi_send(int fd, u32 spi_speed_hz, u8* tx, u8* rx, u32 len,
+                     u16 delay) {
+  spi_backend* backend = fd >= 0 && fd < SPI_MAX_FDS ?
+      spi_fd_backends[fd] : NULL;
+
+  if (!backend) {
+    spi_spidev_send(fd, spi_speed_hz, tx, rx, len, delay);
+  } else {
+    backend->send(fd, spi_speed_hz ? spi_speed_hz : spi_fd_speeds[fd],
+                  tx, rx, len, delay);
+  }
+}
+
+void spi_transfer(int fd, u32 spi_speed_hz, u8* tx, u8* rx, u32 len, u16 delay) {
+  u64 start = stats_now_ns();
+
+  spi_send(fd, spi_speed_hz, tx, rx, len, delay);
+  stats_count_spi(len, start);
+}
+
+void spi_write(int fd, u8* tx, u32 len) {
+  u64 start = stats_now_ns();
+
+  spi_send(fd, 0, tx, NULL, len, 0);
+  stats_count_spi(len, start);
+}
 
 int init_spidev(char dev[], u32 spi_speed_hz) {
+  spi_backend* backend;
   int fd;
-  int result;
+  int i;
   u8 mode = 0;
   u8 bits = SPI_BITS_PER_WORD;
   u32 speed = spi_speed_hz;
 
+  spi_init_backends();
+  for (i = 0; i < spi_num_backends; i++) {
+    backend = spi_backends[i];
+    if (!strncmp(dev, backend->prefix, strlen(backend->prefix))) {
+      fd = backend->open(dev + strlen(backend->prefix), spi_speed_hz);
+      if (fd < 0 || fd >= SPI_MAX_FDS) {
+        fprintf(stderr, "Failed to open device %s\n", dev);
+        if (fd >= 0) close(fd);
+        return -1;
+      }
+      spi_fd_backends[fd] = backend;
+      spi_fd_speeds[fd] = spi_speed_hz ? spi_speed_hz : SPI_DEFAULT_SPEED_HZ;
+      return fd;
+    }
+  }
+
   fd = open(dev, O_RDWR);
   if (fd < 0) {
     fprintf(stderr, "Failed to open device %s\n", dev);
     return -1;
   }
+  if (fd < SPI_MAX_FDS) {
+    spi_fd_backends[fd] = NULL;
+  }
   if (ioctl(fd, SPI_IOC_WR_MODE, &mode) >= 0 &&
       ioctl(fd, SPI_IOC_RD_MODE, &mode) >= 0 &&
       ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) >= 0 &&
       ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits) >= 0 &&
       ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) >= 0 &&
       ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) >= 0) {
+    spi_read_bufsiz();
     return fd;
   }
   close(fd);
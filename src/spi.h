@@ -24,10 +24,46 @@ specific language governing permissions and limitations under the License. */
 #define SPI_MAX_WRITE 4096
 #define SPI_DEFAULT_SPEED_HZ 8000000
 
+/* Where spidev reports its largest message size (default 4096 bytes; */
+/* raise it with the spidev.bufsiz module parameter for fewer syscalls) */
+#define SPI_BUFSIZ_PATH "/sys/module/spidev/parameters/bufsiz"
+
+/* Devices whose paths start with a backend's prefix are opened and sent */
+/* to by that backend instead of spidev, so servers can run without SPI */
+/* hardware.  The built-in backends are: */
+/*   null:             discards everything */
+/*   file:<path>       writes each frame to a file or named pipe */
+/*   throttle:[<path>] takes as long as the frame would on the wire at the */
+/*                     given speed, plus the delay, then discards it (or */
+/*                     writes it to path) */
+typedef struct {
+  char* prefix;
+  /* Opens the device, given the path after the prefix; returns a file */
+  /* descriptor, or -1 on failure. */
+  int (*open)(char* path, u32 spi_speed_hz);
+  /* Sends len bytes from tx, then pauses for delay microseconds. */
+  void (*send)(int fd, u32 spi_speed_hz, u8* tx, u8* rx, u32 len, u16 delay);
+} spi_backend;
+
+#define SPI_MAX_BACKENDS 16
+
+/* Backends only handle file descriptors below this. */
+#define SPI_MAX_FDS 1024
+
+/* Adds a backend; returns 0 if there are too many. */
+u8 spi_register_backend(spi_backend* backend);
+
+/* Sends len bytes from tx (receiving into rx, if not NULL) with */
+/* SPI_IOC_MESSAGE, in as few messages as spidev allows (or with plain */
+/* writes, if the device is not spidev, or with its backend), then pauses */
+/* for delay microseconds. */
 void spi_transfer(int fd, u32 spi_speed_hz, u8* tx, u8* rx, u32 len, u16 delay);
 
+/* Sends len bytes from tx at the speed set by init_spidev. */
 void spi_write(int fd, u8* tx, u32 len);
 
+/* Opens an SPI device, or a device of a backend (see above), and sets its */
+/* speed.  Returns a file descriptor, or -1 on failure. */
 int init_spidev(char dev[], u32 spi_speed_hz);
 
 #endif /* SPI_H */
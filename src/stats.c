@@ -0,0 +1,279 @@
+/* Copyright 2016 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+stats_counters stats;
+__thread u64 stats_thread_spi_ns = 0;
+__thread u64 stats_thread_spi_start_ns = 0;
+u8 stats_timing = 0;
+volatile sig_atomic_t stats_dump_requested = 0;
+
+static stats_histogram stats_histograms[STATS_NUM_STAGES];
+static char* stats_stage_names[STATS_NUM_STAGES] = {
+  "receive", "dispatch", "encode", "spi", "total"
+};
+
+static char* stats_file = NULL;
+static u64 stats_last_ns = 0;
+
+/* The counters as of the last report, for rates over the interval */
+static stats_counters stats_last;
+static opc_stats stats_last_source;
+
+u64 stats_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (u64) now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+void stats_count_spi(u32 len, u64 start_ns) {
+  u64 elapsed = stats_now_ns() - start_ns;
+
+  STATS_ADD(spi_writes, 1);
+  STATS_ADD(spi_bytes, len);
+  STATS_ADD(spi_ns, elapsed);
+  stats_thread_spi_ns += elapsed;
+  if (stats_timing) {
+    stats_record(STATS_SPI, elapsed);
+    if (!stats_thread_spi_start_ns) {
+      stats_thread_spi_start_ns = start_ns;
+    }
+  }
+}
+
+static void stats_request_dump(int signum) {
+  stats_dump_requested = 1;
+}
+
+void stats_enable_timing() {
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stats_request_dump;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, NULL);
+  stats_timing = 1;
+}
+
+/* Returns the bucket for a latency: the exponent of its top bit and the */
+/* 3 bits below that. */
+static int stats_bucket(u64 ns) {
+  int e;
+
+  if (ns < STATS_SUB_BUCKETS) {
+    return ns;
+  }
+  e = 63 - __builtin_clzll(ns);
+  return (e - 2)*STATS_SUB_BUCKETS + ((ns >> (e - 3)) & 7);
+}
+
+/* Returns the least latency that falls in a bucket. */
+static u64 stats_bucket_low(int b) {
+  int e = b/STATS_SUB_BUCKETS + 2;
+
+  if (b < STATS_SUB_BUCKETS) {
+    return b;
+  }
+  return (u64) (STATS_SUB_BUCKETS + b % STATS_SUB_BUCKETS) << (e - 3);
+}
+
+/* Returns the middle of the range of latencies in a bucket. */
+static double stats_bucket_mid(int b) {
+  return b < STATS_SUB_BUCKETS ? b :
+      (stats_bucket_low(b) + stats_bucket_low(b + 1))*0.5;
+}
+
+void stats_record(stats_stage stage, u64 ns) {
+  stats_histogram* h = &stats_histograms[stage];
+
+  __atomic_fetch_add(&h->counts[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+}
+
+/* Returns the latency in microseconds below which a fraction q of the */
+/* latencies in a histogram fall, to within a bucket. */
+static double stats_percentile_us(stats_histogram* h, u64 count, double q) {
+  u64 seen = 0;
+  int b;
+
+  for (b = 0; b < STATS_BUCKETS - 1; b++) {
+    seen += __atomic_load_n(&h->counts[b], __ATOMIC_RELAXED);
+    if (seen > 0 && seen >= q*count) {
+      break;
+    }
+  }
+  return stats_bucket_mid(b)*1e-3;
+}
+
+/* Prints percentiles of each stage's latency. */
+static void stats_dump_histograms() {
+  stats_histogram* h;
+  u64 count;
+  int s;
+
+  fprintf(stderr, "%-9s %10s %9s %9s %9s %9s %9s %9s\n", "Latency",
+          "count", "mean us", "p50", "p90", "p99", "p99.9", "max");
+  for (s = 0; s < STATS_NUM_STAGES; s++) {
+    h = &stats_histograms[s];
+    count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (!count) {
+      continue;
+    }
+    fprintf(stderr, "%-9s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+            stats_stage_names[s], (unsigned long long) count,
+            __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED)*1e-3/count,
+            stats_percentile_us(h, count, 0.5),
+            stats_percentile_us(h, count, 0.9),
+            stats_percentile_us(h, count, 0.99),
+            stats_percentile_us(h, count, 0.999),
+            stats_percentile_us(h, count, 1));
+  }
+}
+
+void stats_set_file(char* path) {
+  stats_file = path;
+}
+
+/* Takes a consistent-enough copy of the counters. */
+static void stats_load(stats_counters* c) {
+  c->frames = __atomic_load_n(&stats.frames, __ATOMIC_RELAXED);
+  c->pixels = __atomic_load_n(&stats.pixels, __ATOMIC_RELAXED);
+  c->encode_ns = __atomic_load_n(&stats.encode_ns, __ATOMIC_RELAXED);
+  c->spi_writes = __atomic_load_n(&stats.spi_writes, __ATOMIC_RELAXED);
+  c->spi_bytes = __atomic_load_n(&stats.spi_bytes, __ATOMIC_RELAXED);
+  c->spi_ns = __atomic_load_n(&stats.spi_ns, __ATOMIC_RELAXED);
+}
+
+static void stats_write_metric(FILE* f, char* name, char* type, char* help,
+                               double value) {
+  fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n",
+          name, help, name, type, name, value);
+}
+
+/* Powers of two (in ns) to use as the bucket bounds in the file, from */
+/* about 1 us to about 1 s */
+#define STATS_FILE_MIN_POWER 10
+#define STATS_FILE_MAX_POWER 30
+
+/* Writes the latency histograms, with cumulative buckets at powers of two. */
+static void stats_write_histograms(FILE* f) {
+  stats_histogram* h;
+  u64 below;
+  int s;
+  int k;
+  int b;
+
+  fprintf(f, "# HELP opc_stage_seconds Latency of each stage of handling "
+          "a frame.\n# TYPE opc_stage_seconds histogram\n");
+  for (s = 0; s < STATS_NUM_STAGES; s++) {
+    h = &stats_histograms[s];
+    below = 0;
+    b = 0;
+    for (k = STATS_FILE_MIN_POWER; k <= STATS_FILE_MAX_POWER; k++) {
+      /* Buckets below (k - 2)*STATS_SUB_BUCKETS hold latencies below 2^k. */
+      for (; b < (k - 2)*STATS_SUB_BUCKETS; b++) {
+        below += __atomic_load_n(&h->counts[b], __ATOMIC_RELAXED);
+      }
+      fprintf(f, "opc_stage_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+              stats_stage_names[s], (double) ((u64) 1 << k)*1e-9,
+              (unsigned long long) below);
+    }
+    fprintf(f, "opc_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+            "opc_stage_seconds_sum{stage=\"%s\"} %.9g\n"
+            "opc_stage_seconds_count{stage=\"%s\"} %llu\n",
+            stats_stage_names[s], (unsigned long long) h->count,
+            stats_stage_names[s], h->sum_ns*1e-9,
+            stats_stage_names[s], (unsigned long long) h->count);
+  }
+}
+
+/* Writes the counters to a temporary file and renames it over the stats */
+/* file, so that a reader never sees a partly written file. */
+static void stats_write_file(stats_counters* c, opc_stats* s) {
+  char temp[256];
+  FILE* f;
+
+  snprintf(temp, sizeof(temp), "%s.tmp", stats_file);
+  if (!(f = fopen(temp, "w"))) {
+    fprintf(stderr, "Could not write %s\n", temp);
+    return;
+  }
+  stats_write_metric(f, "opc_messages_total", "counter",
+                     "OPC messages received.", s->messages);
+  stats_write_metric(f, "opc_received_bytes_total", "counter",
+                     "Bytes of OPC messages received.", s->bytes);
+  stats_write_metric(f, "opc_dropped_total", "counter",
+                     "Pixel messages skipped as stale or malformed.",
+                     s->dropped);
+  stats_write_metric(f, "opc_frames_total", "counter",
+                     "Pixel messages handed to the LED driver.", c->frames);
+  stats_write_metric(f, "opc_pixels_total", "counter",
+                     "Pixels handed to the LED driver.", c->pixels);
+  stats_write_metric(f, "opc_encode_seconds_total", "counter",
+                     "Time spent correcting, encoding and framing pixels.",
+                     c->encode_ns*1e-9);
+  stats_write_metric(f, "opc_spi_writes_total", "counter",
+                     "Frames written to SPI devices.", c->spi_writes);
+  stats_write_metric(f, "opc_spi_bytes_total", "counter",
+                     "Bytes written to SPI devices.", c->spi_bytes);
+  stats_write_metric(f, "opc_spi_seconds_total", "counter",
+                     "Time spent writing to SPI devices.", c->spi_ns*1e-9);
+  if (stats_timing) {
+    stats_write_histograms(f);
+  }
+  if (fclose(f) != 0 || rename(temp, stats_file) != 0) {
+    fprintf(stderr, "Could not write %s\n", stats_file);
+  }
+}
+
+void stats_tick(opc_source source) {
+  u64 now = stats_now_ns();
+  double seconds = (now - stats_last_ns)*1e-9;
+  stats_counters c;
+  opc_stats s;
+  u64 frames;
+  u64 writes;
+
+  if (stats_dump_requested) {
+    stats_dump_requested = 0;
+    stats_dump_histograms();
+  }
+  if (now - stats_last_ns < (u64) STATS_INTERVAL_MS*1000000) {
+    return;
+  }
+  stats_load(&c);
+  opc_get_stats(source, &s);
+  frames = c.frames - stats_last.frames;
+  writes = c.spi_writes - stats_last.spi_writes;
+
+  /* Stay quiet while nothing is arriving. */
+  if (stats_last_ns && (frames || s.messages != stats_last_source.messages)) {
+    fprintf(stderr, "%.1f frames/s, %llu dropped, %.1f kB/s in, "
+            "%.1f kB/s out, encode %.1f us/frame, SPI %.1f us/write\n",
+            frames/seconds,
+            (unsigned long long) (s.dropped - stats_last_source.dropped),
+            (s.bytes - stats_last_source.bytes)/seconds*1e-3,
+            (c.spi_bytes - stats_last.spi_bytes)/seconds*1e-3,
+            frames ? (c.encode_ns - stats_last.encode_ns)*1e-3/frames : 0,
+            writes ? (c.spi_ns - stats_last.spi_ns)*1e-3/writes : 0);
+  }
+  if (stats_file) {
+    stats_write_file(&c, &s);
+  }
+  stats_last = c;
+  stats_last_source = s;
+  stats_last_ns = now;
+}
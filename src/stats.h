@@ -0,0 +1,101 @@
+/* Copyright 2016 Ka-Ping Yee
+
+Licensed under the Apache License, Version 2.0 (the "License"); you may not
+use this file except in compliance with the License.  You may obtain a copy
+of the License at: http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations under the License. */
+
+// Counters of the work an LED server does, and optional histograms of how
+// long each stage of handling a frame takes, reported periodically as a
+// summary line and optionally as a file in Prometheus text format.
+#ifndef STATS_H
+#define STATS_H
+
+#include <signal.h>
+#include "opc.h"
+#include "types.h"
+
+/* Milliseconds between reports */
+#define STATS_INTERVAL_MS 10000
+
+/* Counters since the server started.  Any thread may add to them, with */
+/* relaxed atomic adds (STATS_ADD), so they never take a lock. */
+typedef struct {
+  u64 frames;  /* pixel messages handed to the LED driver */
+  u64 pixels;  /* pixels in those messages */
+  u64 encode_ns;  /* time to correct, encode and frame them */
+  u64 spi_writes;  /* frames written to SPI devices */
+  u64 spi_bytes;  /* bytes in those frames */
+  u64 spi_ns;  /* time spent writing them */
+} stats_counters;
+
+extern stats_counters stats;
+
+/* Time spent in SPI writes by the calling thread, so that a caller can */
+/* take out the SPI time from a span that includes writes. */
+extern __thread u64 stats_thread_spi_ns;
+
+#define STATS_ADD(counter, n) \
+    __atomic_fetch_add(&stats.counter, (n), __ATOMIC_RELAXED)
+
+/* The stages of a frame's latency, when timing is on: */
+/*   receive: from the socket becoming readable to the read returning */
+/*   dispatch: from then to the handler being called */
+/*   encode: from then to the first SPI write starting (or the handler */
+/*     returning, if it writes nothing itself) */
+/*   spi: each SPI write, on whatever thread makes it */
+/*   total: from the socket becoming readable to the handler returning */
+typedef enum {
+  STATS_RECEIVE, STATS_DISPATCH, STATS_ENCODE, STATS_SPI, STATS_TOTAL
+} stats_stage;
+#define STATS_NUM_STAGES 5
+
+/* Each latency histogram has 8 buckets for every power of two from 8 ns */
+/* up (exact below 8 ns), so every bucket is within 12.5% of its values, */
+/* as in an HDR histogram with 3 bits of precision. */
+#define STATS_SUB_BUCKETS 8
+#define STATS_BUCKETS (62*STATS_SUB_BUCKETS)
+
+typedef struct {
+  u64 counts[STATS_BUCKETS];
+  u64 count;
+  u64 sum_ns;
+} stats_histogram;
+
+/* Nonzero if latency timing is on; set by stats_enable_timing. */
+extern u8 stats_timing;
+
+/* Set by SIGUSR1 while timing is on; stats_tick then dumps the histograms. */
+extern volatile sig_atomic_t stats_dump_requested;
+
+/* The time the calling thread's first SPI write since the handler began */
+/* started, or 0 if it has made none. */
+extern __thread u64 stats_thread_spi_start_ns;
+
+/* Returns the CLOCK_MONOTONIC time in nanoseconds. */
+u64 stats_now_ns();
+
+/* Counts an SPI write of len bytes that began at start_ns. */
+void stats_count_spi(u32 len, u64 start_ns);
+
+/* Turns on latency timing and makes SIGUSR1 dump the histograms. */
+void stats_enable_timing();
+
+/* Adds a latency to the histogram for a stage. */
+void stats_record(stats_stage stage, u64 ns);
+
+/* Sets a file to rewrite with the counters in Prometheus text format at */
+/* each report, or NULL (the default) for none. */
+void stats_set_file(char* path);
+
+/* Reports the counters, along with those of an OPC source, if */
+/* STATS_INTERVAL_MS has passed since the last report, and dumps the */
+/* latency histograms to stderr if SIGUSR1 has asked for them.  Call this */
+/* often. */
+void stats_tick(opc_source source);
+
+#endif /* STATS_H */
@@ -10,44 +10,105 @@ CONDITIONS OF ANY KIND, either express or implied.  See the License for the
 specific language governing permissions and limitations under the License. */
 
 #include "cli.h"
+#include "encode.h"
 #include "spi.h"
 #include "opc.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
-static u8 buffers[10][4 + OPC_MAX_PIXELS_PER_MESSAGE * 4];
-static int buffer_lens[10];
-static int num_spi_fds = 0;
-static int spi_fds[10];
-static int firsts[10];
-static int lasts[10];
+// Each SPI device has its own output thread, so the blocking writes to
+// several buses happen at the same time.  tcl_put_pixels fills the back
+// buffer while the thread writes the other one; ready is the index of a
+// filled buffer the thread has yet to take (or -1), and writing the index
+// of the buffer it is writing (or -1).  If a new frame is filled before the
+// thread takes the last one, the thread skips straight to the new one.
+// The device shows pixels first to last of each frame, or from first to
+// the end if last is DEVICE_TO_END.
+#define DEVICE_TO_END ((u32) -1)
+typedef struct {
+  int fd;
+  u32 first;
+  u32 last;
+  u32 lens[2];
+  int back;
+  int ready;
+  int writing;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+} device;
 
-void tcl_put_pixels(u8* dummy, u16 count, pixel* pixels) {
+static u8 buffers[10][2][4 + OPC_MAX_PIXELS_PER_FRAME * 4];
+static int num_devices = 0;
+static device devices[10];
+static encode_func* encode;
+
+void* tcl_write_device(void* arg) {
+  device* dev = arg;
+  int b;
+
+  pthread_mutex_lock(&dev->lock);
+  while (1) {
+    dev->writing = -1;
+    pthread_cond_broadcast(&dev->cond);
+    while (dev->ready < 0) {
+      pthread_cond_wait(&dev->cond, &dev->lock);
+    }
+    b = dev->writing = dev->ready;
+    dev->ready = -1;
+    pthread_mutex_unlock(&dev->lock);
+    spi_write(dev->fd, buffers[dev - devices][b], dev->lens[b]);
+    pthread_mutex_lock(&dev->lock);
+  }
+  return NULL;
+}
+
+void tcl_put_pixels(u8* dummy, u32 count, pixel* pixels) {
+  device* dev;
   int c;
-  int i;
-  pixel* p;
+  u32 end;
   u8* d;
-  u8 flag;
 
-  for (c = 0; c < num_spi_fds; c++) {
-    d = buffers[c];
+  for (c = 0; c < num_devices; c++) {
+    dev = &devices[c];
+
+    // Wait until the thread is not writing the back buffer.
+    pthread_mutex_lock(&dev->lock);
+    while (dev->writing == dev->back) {
+      pthread_cond_wait(&dev->cond, &dev->lock);
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    d = buffers[c][dev->back];
     *d++ = 0;
     *d++ = 0;
     *d++ = 0;
     *d++ = 0;
-    for (i = firsts[c], p = pixels + firsts[c];
-         i < count && (lasts[c] < 0 || i <= lasts[c]);
-         i++, p++) {
-      flag = (p->r & 0xc0) >> 6 | (p->g & 0xc0) >> 4 | (p->b & 0xc0) >> 2;
-      *d++ = ~flag;
-      *d++ = p->b;
-      *d++ = p->g;
-      *d++ = p->r;
+    end = dev->last < count ? dev->last + 1 : count;
+    if (dev->first < end) {
+      d += encode(d, pixels + dev->first, end - dev->first);
     }
-    buffer_lens[c] = d - buffers[c];
+    dev->lens[dev->back] = d - buffers[c][dev->back];
+
+    // Hand the filled buffer to the thread and take the other one.
+    pthread_mutex_lock(&dev->lock);
+    dev->ready = dev->back;
+    dev->back ^= 1;
+    pthread_cond_broadcast(&dev->cond);
+    pthread_mutex_unlock(&dev->lock);
   }
-  for (c = 0; c < num_spi_fds; c++) {
-    spi_write(spi_fds[c], buffers[c], buffer_lens[c]);
+}
+
+void start_device(device* dev) {
+  dev->back = 0;
+  dev->ready = -1;
+  dev->writing = -1;
+  pthread_mutex_init(&dev->lock, NULL);
+  pthread_cond_init(&dev->cond, NULL);
+  if (pthread_create(&dev->thread, NULL, tcl_write_device, dev) != 0) {
+    fprintf(stderr, "Could not start output thread\n");
+    exit(1);
   }
 }
 
@@ -55,23 +116,28 @@ int parse_int(char* str, int fallback) {
   return (str != NULL && *str >= '0' && *str <= '9') ? atoi(str) : fallback;
 }
 
-void parse_channel_spec(char* spec, char** device_path, int* first, int* last) {
+void parse_channel_spec(char* spec, char** device_path, u32* first, u32* last) {
   char* buffer = strdup(spec);  // never freed
   char* empty = "";
   char* colon;
   char* hyphen;
   char* f;
   char* l;
-  char* c;
 
-  colon = strchr(buffer, ':');
+  // Only a last colon followed by a pixel range starts one, since device
+  // paths such as "file:/tmp/frames" (see spi.h) can contain colons.
+  colon = strrchr(buffer, ':');
+  if (colon != NULL &&
+      (!colon[1] || strspn(colon + 1, "0123456789-") != strlen(colon + 1))) {
+    colon = NULL;
+  }
   *device_path = buffer;
   if (colon != NULL) *colon = 0;
   f = colon == NULL ? empty : colon + 1;
   hyphen = strchr(f, '-');
   l = hyphen == NULL ? empty : hyphen + 1;
   *first = parse_int(f, 0);
-  *last = parse_int(l, -1);
+  *last = parse_int(l, DEVICE_TO_END);
 }
 
 int main(int argc, char** argv) {
@@ -79,25 +145,33 @@ int main(int argc, char** argv) {
   u32 spi_speed_hz = 8000000;
   int c;
 
+  get_server_options(&argc, &argv);
+
   get_speed_and_port(&spi_speed_hz, &port, argc, argv);
   if (argc > 3) {
-    num_spi_fds = argc - 3;
-    for (c = 0; c < num_spi_fds; c++) {
+    num_devices = argc - 3 > 10 ? 10 : argc - 3;
+    for (c = 0; c < num_devices; c++) {
       char* device_path;
-      parse_channel_spec(argv[c + 3], &device_path, &firsts[c], &lasts[c]);
-      spi_fds[c] = opc_open_spi(device_path, spi_speed_hz);
-      if (lasts[c] < 0) {
-        fprintf(stderr, "%s: from pixel %d onward\n", device_path, firsts[c]);
+      parse_channel_spec(argv[c + 3], &device_path,
+                         &devices[c].first, &devices[c].last);
+      devices[c].fd = opc_open_spi(device_path, spi_speed_hz);
+      if (devices[c].last == DEVICE_TO_END) {
+        fprintf(stderr, "%s: from pixel %u onward\n",
+                device_path, devices[c].first);
       } else {
-        fprintf(stderr, "%s: from pixel %d to pixel %d inclusive\n",
-                device_path, firsts[c], lasts[c]);
+        fprintf(stderr, "%s: from pixel %u to pixel %u inclusive\n",
+                device_path, devices[c].first, devices[c].last);
       }
     }
   } else {
-    num_spi_fds = 1;
-    spi_fds[0] = opc_open_spi("/dev/spidev1.0", spi_speed_hz);
-    firsts[0] = 0;
-    lasts[0] = -1;
+    num_devices = 1;
+    devices[0].fd = opc_open_spi("/dev/spidev1.0", spi_speed_hz);
+    devices[0].first = 0;
+    devices[0].last = DEVICE_TO_END;
+  }
+  encode = encode_get(TCL, BGR, 0);
+  for (c = 0; c < num_devices; c++) {
+    start_device(&devices[c]);
   }
   return opc_serve_main(port, tcl_put_pixels, NULL);
 }
@@ -44,9 +44,19 @@ typedef uint32_t u32;
 typedef int32_t s32;
 #endif
 
+#ifndef TYPEDEF_U64
+#define TYPEDEF_U64
+typedef uint64_t u64;
+#endif
+
 #ifndef TYPEDEF_PIXEL
 #define TYPEDEF_PIXEL
 typedef struct { u8 r, g, b; } pixel;
 #endif
 
+#ifndef TYPEDEF_PIXEL16
+#define TYPEDEF_PIXEL16
+typedef struct { u16 r, g, b, w; } pixel16;
+#endif
+
 #endif /* OPC_TYPES_H */
@@ -1,3 +1,5 @@
+#include "cli.h"
+#include "encode.h"
 #include "spi.h"
 #include "opc.h"
 
@@ -9,65 +11,38 @@
 #define WS2801_DEFAULT_SPEED 4000000
 
 // Different WS2801 strips expect different input color orderings.
-typedef enum { RGB=0, GRB=1, BGR=2 } order_t;
+// Strips with a white LED take an order such as "grbw".
 #define DEFAULT_INPUT_ORDER RGB
 
 static u32 spi_speed_hz = WS2801_DEFAULT_SPEED;
-static u8 buffer[1 << 16];
+static u8 buffer[OPC_MAX_PIXELS_PER_FRAME * 4];
 static order_t rgb_order = DEFAULT_INPUT_ORDER;
+static u8 rgbw = 0;
+static encode_func* encode;
 static int spi_fd;
 
-void ws2801_put_pixels(u8 buffer[], u16 count, pixel* pixels) {
-  int i;
-  pixel* p;
+void ws2801_put_pixels(u8 buffer[], u32 count, pixel* pixels) {
   u8* d;
 
   d = buffer;
-  for (i = 0, p = pixels; i < count; i++, p++) {
-    switch (rgb_order)
-    {
-    case RGB:
-      *d++ = p->r;
-      *d++ = p->g;
-      *d++ = p->b;
-      break;
-    case GRB:
-      *d++ = p->g;
-      *d++ = p->r;
-      *d++ = p->b;
-      break;
-    case BGR:
-      *d++ = p->b;
-      *d++ = p->g;
-      *d++ = p->r;
-      break;
-    }
-  }
+  d += encode(d, pixels, count);
   spi_transfer(spi_fd, spi_speed_hz, buffer, 0, d - buffer, POST_TX_DELAY_USECS);
 }
 
-order_t get_order(int argc, char** argv) {
-  order_t order = DEFAULT_INPUT_ORDER;
-  if (argc > 3) {
-    if (!strcmp(argv[3], "rgb")) {
-      order = RGB;
-    } else if (!strcmp(argv[3], "grb")) {
-      order = GRB;
-    } else if (!strcmp(argv[3], "bgr")) {
-      order = BGR;
-    } else {
-      fprintf(stderr, "Did not recognize color order argument - using default\n");
-    }
-  }
-  return order;
-}
-
 int main(int argc, char** argv) {
   u16 port = OPC_DEFAULT_PORT;
   char* spi_device_path = "/dev/spidev1.0";
 
+  get_server_options(&argc, &argv);
+
   get_speed_and_port(&spi_speed_hz, &port, argc, argv);
-  rgb_order = get_order(argc, argv);
+  if (argc > 3 && !encode_parse_order(argv[3], &rgb_order, &rgbw)) {
+    fprintf(stderr, "Did not recognize color order argument - using default\n");
+  }
+  if (argc > 4) {
+    spi_device_path = argv[4];
+  }
+  encode = encode_get(WS2801, rgb_order, rgbw);
   spi_fd = opc_open_spi(spi_device_path, spi_speed_hz);
   return opc_serve_main(port, ws2801_put_pixels, buffer);
 }